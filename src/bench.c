@@ -0,0 +1,287 @@
+/*
+ * bench.c - offline benchmark of the hdapsd detection code
+ *
+ * Runs the detector and the sysfs parsers over synthetic scenarios and over
+ * traces recorded with "hdapsd --record", and reports the cost per sample
+ * and how many samples it takes to detect an event.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+#include "replay.h"
+#include "sysfs-helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_REPEAT		200	/* timing runs per recording */
+#define BENCH_PARSE_LOOPS	1000000
+#define BENCH_TOLERANCE		0.01	/* fraction of decisions the kernels may differ in */
+
+static const struct {
+	const char *name;
+	kernel_fn step;
+} kernels[] = {
+	{ "double", detector_step_double },
+	{ "fixed", detector_step_fixed },
+};
+#define NUM_KERNELS	((int)(sizeof(kernels)/sizeof(kernels[0])))
+
+static struct detector detector[NUM_KERNELS];
+static int two_axis = 0;
+static int predict = 0;
+static int disagree = 0;	/* kernels differ beyond BENCH_TOLERANCE */
+#ifdef DETECTOR_FIXED_POINT
+static const int build_kernel = 1;
+#else
+static const int build_kernel = 0;
+#endif
+
+static double now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *xmalloc (size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+/*
+ * compare() - run all kernels, count the decisions differing from the one
+ * selected at build time. The decisions of that one are left in park.
+ */
+static int compare (const struct recording *r, char *park)
+{
+	char *other = xmalloc(r->n);
+	int i, k, differ = 0;
+
+	for (k = 0; k < NUM_KERNELS; k++)
+		detector[k].three_axis = r->three_axis && !two_axis;
+	replay_run(&detector[build_kernel], kernels[build_kernel].step, r, park);
+	for (k = 0; k < NUM_KERNELS; k++) {
+		if (k == build_kernel)
+			continue;
+		replay_run(&detector[k], kernels[k].step, r, other);
+		for (i = 0; i < r->n; i++)
+			differ += park[i] != other[i];
+	}
+	free(other);
+	if (differ > r->n*BENCH_TOLERANCE)
+		disagree = 1;
+	return differ;
+}
+
+/*
+ * print_times() - the cost of each kernel per sample
+ */
+static void print_times (const struct recording *r)
+{
+	double start, ns;
+	int i, k;
+
+	for (k = 0; k < NUM_KERNELS; k++) {
+		start = now_ns();
+		for (i = 0; i < BENCH_REPEAT; i++)
+			replay_run(&detector[k], kernels[k].step, r, NULL);
+		ns = (now_ns() - start) / ((double)r->n * BENCH_REPEAT);
+		printf(" %8.1f %6.1fM", ns, 1e3/ns);
+	}
+}
+
+/*
+ * print_predicted() - precision of the predicted parks of the last replay
+ */
+static void print_predicted (void)
+{
+	const struct predictor *p = &detector[build_kernel].pred;
+	char buf[32];
+
+	if (!predict)
+		return;
+	snprintf(buf, sizeof(buf), "%lu/%lu", p->confirmed, p->parks);
+	printf(" %9s", buf);
+}
+
+static void bench_scenarios (void)
+{
+	struct recording r;
+	char *park;
+	int i, j, k, parks, first, onset, differ;
+	char latency[32];
+
+	printf("%-8s %7s", "scenario", "samples");
+	for (k = 0; k < NUM_KERNELS; k++)
+		printf(" %8s %7s", kernels[k].name, "smp/s");
+	printf(" %5s %8s %6s", "parks", "latency", "differ");
+	if (predict)
+		printf(" %9s", "predicted");
+	printf("\n");
+
+	for (j = 0; j < replay_num_scenarios(); j++) {
+		if (replay_scenario(&r, j)) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		park = xmalloc(r.n);
+		differ = compare(&r, park);
+		onset = r.onset * r.rate;
+		for (parks = 0, first = -1, i = 0; i < r.n; i++) {
+			parks += park[i];
+			if (park[i] && first < 0 && i >= onset)
+				first = i;
+		}
+		if (first >= 0)
+			snprintf(latency, sizeof(latency), "%d smp", first - onset);
+		else
+			snprintf(latency, sizeof(latency), "-");
+
+		printf("%-8s %7d", r.name, r.n);
+		print_times(&r);
+		printf(" %5d %8s %6d", parks, latency, differ);
+		print_predicted();
+		printf(" %s\n", (parks > 0) == r.event ? "ok" :
+		       (r.event ? "MISSED" : "FALSE PARK"));
+		free(park);
+		replay_free(&r);
+	}
+	printf("(ns/sample and samples/s per kernel, parks and latency with the %s kernel)\n",
+	       kernels[build_kernel].name);
+	if (predict)
+		printf("(predicted: parks issued by the predictor, confirmed/issued)\n");
+}
+
+static void bench_parsers (void)
+{
+	static const char *hdaps = "(-498,-439)\n";
+	static const char *ams = "12 -3 1024\n";
+	volatile int sink = 0;
+	int i, val[3];
+	double start;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_PARSE_LOOPS; i++)
+		sink += parse_tuple(hdaps, '(', ',', val, 2);
+	printf("parse_tuple \"(x,y)\"   %6.1f ns\n", (now_ns() - start) / BENCH_PARSE_LOOPS);
+
+	start = now_ns();
+	for (i = 0; i < BENCH_PARSE_LOOPS; i++)
+		sink += parse_tuple(ams, 0, ' ', val, 3);
+	printf("parse_tuple \"x y z\"   %6.1f ns\n", (now_ns() - start) / BENCH_PARSE_LOOPS);
+}
+
+/*
+ * bench_trace() - replay a recorded trace, compare the decisions with the
+ * ones the daemon made while recording and between the kernels
+ */
+static int bench_trace (const char *path)
+{
+	struct recording r;
+	char *park;
+	int i, ret, parks = 0, rec_parks = 0, differ, changed = 0;
+
+	ret = replay_trace(&r, path);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+		return 1;
+	}
+	if (r.n == 0) {
+		printf("%s: no software-logic samples\n", path);
+		return 0;
+	}
+
+	park = xmalloc(r.n);
+	differ = compare(&r, park);
+	for (i = 0; i < r.n; i++) {
+		parks += park[i];
+		rec_parks += r.recorded[i];
+		changed += park[i] != r.recorded[i];
+	}
+
+	printf("%s: %d samples at %g Hz\n   ", path, r.n, r.rate);
+	print_times(&r);
+	printf(" %5d parks (%d recorded, %d decisions changed), "
+	       "%d differ between kernels", parks, rec_parks, changed, differ);
+	if (predict)
+		printf(", %lu of %lu predicted parks confirmed",
+		       detector[build_kernel].pred.confirmed,
+		       detector[build_kernel].pred.parks);
+	printf("\n");
+	free(park);
+	replay_free(&r);
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	int i, k, ret = 0, threshold = 15, adaptive = 0, auto_threshold = 0;
+
+	while ((i = getopt(argc, argv, "s:aA2P")) != -1) {
+		switch (i) {
+		case 's':
+			threshold = atoi(optarg);
+			break;
+		case 'a':
+			adaptive = 1;
+			break;
+		case 'A':
+			auto_threshold = 1;
+			break;
+		case '2':
+			two_axis = 1; /* ignore z, as before free-fall detection */
+			break;
+		case 'P':
+			predict = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s sensitivity] [-a] [-A] [-2] [-P] [trace...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for (k = 0; k < NUM_KERNELS; k++) {
+		detector_init(&detector[k], threshold, adaptive);
+		detector[k].auto_threshold = auto_threshold;
+		detector[k].predict = predict;
+	}
+	printf(PACKAGE_NAME" detection benchmark, threshold %d%s%s%s, %d Hz\n\n",
+	       threshold, adaptive ? " (adaptive)" : "",
+	       auto_threshold ? " (automatic)" : "",
+	       predict ? " (predictive)" : "", REPLAY_RATE);
+	bench_scenarios();
+	printf("\n");
+	bench_parsers();
+	if (optind < argc)
+		printf("\n");
+	for (i = optind; i < argc; i++)
+		ret |= bench_trace(argv[i]);
+	fflush(stdout);
+	if (disagree)
+		fprintf(stderr, "The detection kernels disagree in more than %g%% of the decisions.\n",
+		        BENCH_TOLERANCE*100);
+	return ret || disagree;
+}
@@ -0,0 +1,190 @@
+/*
+ * control.c - the local control socket, one command per line
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "control.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+static struct control_client clients[CONTROL_MAX_CLIENTS] = {
+	[0 ... CONTROL_MAX_CLIENTS-1] = { .fd = -1 }
+};
+
+/*
+ * control_open() - listen on a unix socket at path, mode 0600 so that only
+ *                  root may connect. A stale socket is replaced, but not
+ *                  one a running daemon still answers on (-EADDRINUSE) nor
+ *                  a file that is no socket (-EEXIST). Returns the socket,
+ *                  or -errno.
+ */
+int control_open(const char *path) {
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int fd, err;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			err = -EEXIST;
+		else if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 ||
+		         errno == EAGAIN)
+			err = -EADDRINUSE;
+		else
+			err = unlink(path) ? -errno : 0;
+		close(fd);
+		if (err)
+			return err;
+		fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -errno;
+	}
+	mask = umask(0077);
+	err = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	if (err || chmod(path, 0600) || listen(fd, CONTROL_MAX_CLIENTS)) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	return fd;
+}
+
+/*
+ * control_accept() - accept a connection, NULL if there is no free slot
+ *                    (the connection is refused) or accepting failed
+ */
+struct control_client *control_accept(int listen_fd) {
+	struct control_client *c = control_find(-1);
+	int fd;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return NULL;
+	fcntl(fd, F_SETFL, O_RDWR|O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if (c == NULL) {
+		close(fd);
+		return NULL;
+	}
+	c->fd = fd;
+	c->len = 0;
+	return c;
+}
+
+/*
+ * control_find() - the client connected through fd, or a free slot for -1
+ */
+struct control_client *control_find(int fd) {
+	int i;
+
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		if (clients[i].fd == fd)
+			return &clients[i];
+	return NULL;
+}
+
+/*
+ * control_read() - read what the client sent and pass each complete line,
+ *                  without the newline, to handle. Returns -1 when the
+ *                  client is gone or sent a line that is too long.
+ */
+int control_read(struct control_client *c, control_handler handle) {
+	char *line, *nl;
+	ssize_t ret;
+
+	while (1) {
+		ret = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		if (ret <= 0)
+			return -1;
+		c->len += ret;
+
+		line = c->buf;
+		while ((nl = memchr(line, '\n', c->len - (line - c->buf))) != NULL) {
+			*nl = 0;
+			if (nl > line && nl[-1] == '\r')
+				nl[-1] = 0;
+			handle(c, line);
+			if (c->fd < 0)
+				return -1; /* closed by the handler */
+			line = nl + 1;
+		}
+		c->len -= line - c->buf;
+		memmove(c->buf, line, c->len);
+		if (c->len == sizeof(c->buf))
+			return -1;
+	}
+}
+
+/*
+ * control_reply() - send a line to the client. Replies are short; if the
+ *                   client doesn't read them, they are lost.
+ */
+void control_reply(struct control_client *c, const char *fmt, ...) {
+	char buf[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf) - 1, fmt, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if ((size_t) len > sizeof(buf) - 2)
+		len = sizeof(buf) - 2;
+	buf[len++] = '\n';
+	send(c->fd, buf, len, MSG_NOSIGNAL);
+}
+
+/*
+ * control_close() - hang up on a client
+ */
+void control_close(struct control_client *c) {
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+}
+
+/*
+ * control_shutdown() - hang up on all clients and remove the socket
+ */
+void control_shutdown(int listen_fd, const char *path) {
+	int i;
+
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		control_close(&clients[i]);
+	close(listen_fd);
+	unlink(path);
+}
@@ -0,0 +1,22 @@
+#include <stddef.h>
+
+#define CONTROL_MAX_CLIENTS	4
+#define CONTROL_LINE_MAX	128	/* longest command line */
+
+/* A connection to the control socket */
+struct control_client {
+	int fd;				/* -1 if the slot is free */
+	char buf[CONTROL_LINE_MAX];	/* start of an incomplete line */
+	size_t len;
+};
+
+typedef void (*control_handler)(struct control_client *c, char *line);
+
+int control_open(const char *path);
+struct control_client *control_accept(int listen_fd);
+struct control_client *control_find(int fd);
+int control_read(struct control_client *c, control_handler handle);
+void control_reply(struct control_client *c, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+void control_close(struct control_client *c);
+void control_shutdown(int listen_fd, const char *path);
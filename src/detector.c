@@ -0,0 +1,726 @@
+/*
+ * detector.c - the software fall detection logic of hdapsd
+ *
+ * Copyright (C) 2005-2014 Jon Escombe <lists@dresco.co.uk>
+ *                         Robert Love <rml@novell.com>
+ *                         Shem Multinymous <multinymous@gmail.com>
+ *                         Elias Oltmanns <eo@nebensachen.de>
+ *                         Evgeni Golov <evgeni@golov.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+#include "detector.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+/*
+ * check_thresh() - compare a value to the threshold, reason_out may be NULL
+ */
+void check_thresh (double val_sqr, double thresh, double near_factor,
+                   int* above, int* near, char* reason_out, char reason_mark)
+{
+	if (val_sqr > thresh*thresh*near_factor*near_factor) {
+		*near = 1;
+		if (reason_out)
+			*reason_out = tolower(reason_mark);
+	}
+	if (val_sqr > thresh*thresh) {
+		*above = 1;
+		if (reason_out)
+			*reason_out = toupper(reason_mark);
+	}
+}
+
+/*
+ * detector_init() - set up a detector, thresholds as for -s and -a
+ */
+void detector_init (struct detector *d, double base_threshold, int adaptive)
+{
+	memset(d, 0, sizeof(*d));
+	d->base_threshold = base_threshold;
+	d->adaptive = adaptive;
+	d->params.near_thresh_factor = NEAR_THRESH_FACTOR;
+	d->params.parked_thresh_factor = PARKED_THRESH_FACTOR;
+	d->params.thresh_increase_factor = THRESH_INCREASE_FACTOR;
+	d->params.thresh_decrease_factor = THRESH_DECREASE_FACTOR;
+	d->params.avg_depth_sec = AVG_DEPTH_SEC;
+	detector_reset(d);
+}
+
+/*
+ * detector_reset() - forget all past samples, keep the configuration
+ */
+void detector_reset (struct detector *d)
+{
+	d->x_last = d->y_last = 0;
+	d->unow_last = d->x_veloc_last = d->y_veloc_last = 0;
+	d->x_avg_veloc = d->y_avg_veloc = 0;
+	d->history = 0;
+	d->near = 0;
+	d->adaptive_threshold = d->base_threshold;
+	d->last_thresh_change = 0;
+	d->last_near_thresh = 0;
+	d->last_km_activity = 0;
+	d->g_ref = 0;
+	d->g_settled = 0;
+	d->low_samples = 0;
+	memset(&d->fx, 0, sizeof(d->fx));
+	d->fx.thresh = -1;
+	memset(&d->noise, 0, sizeof(d->noise));
+	d->noise_sigma = 0;
+	d->noise_threshold = 0;
+	memset(&d->pred, 0, sizeof(d->pred));
+	d->speculative = 0;
+}
+
+/*
+ * detector_km_activity() - the built-in keyboard or mouse was used at unow.
+ * For event sources, instead of polling them through km_activity.
+ */
+void detector_km_activity (struct detector *d, double unow)
+{
+	d->last_km_activity = unow;
+}
+
+/*
+ * noise_clip() - velocities beyond NOISE_CLIP_FACTOR times the current noise
+ * estimate (or, before there is one, the noise -s would tolerate) are
+ * clipped. A shock or a fall then hardly changes the estimate, while
+ * stronger noise, like on a train, still raises it window by window.
+ */
+static void noise_clip (struct detector *d)
+{
+	double sigma = d->base_threshold * VELOC_ADJUST / NOISE_THRESH_FACTOR;
+
+	if (d->noise_sigma > sigma)
+		sigma = d->noise_sigma;
+	sigma *= NOISE_CLIP_FACTOR;
+	d->noise.clip = sigma < NOISE_VELOC_MAX ? (int64_t)sigma : NOISE_VELOC_MAX;
+}
+
+/*
+ * noise_add() - add a velocity to the noise estimate. When the window is
+ * full, derive the threshold at which the noise would reach the velocity
+ * threshold only every NOISE_THRESH_FACTOR sigma.
+ */
+static void noise_add (struct detector *d, int64_t x_veloc, int64_t y_veloc)
+{
+	struct noise_estimate *n = &d->noise;
+	int64_t v[2] = { x_veloc, y_veloc }, old, var = 0;
+	int i;
+
+	if (n->clip == 0)
+		noise_clip(d);
+	for (i = 0; i < 2; i++) {
+		if (v[i] > n->clip)
+			v[i] = n->clip;
+		else if (v[i] < -n->clip)
+			v[i] = -n->clip;
+		if (n->count == NOISE_WINDOW) {
+			old = n->veloc[n->pos][i];
+			n->sum[i] -= old;
+			n->sum_sqr[i] -= old*old;
+		}
+		n->veloc[n->pos][i] = v[i];
+		n->sum[i] += v[i];
+		n->sum_sqr[i] += v[i]*v[i];
+	}
+	if (n->count < NOISE_WINDOW)
+		n->count++;
+	if (++n->pos < NOISE_WINDOW)
+		return;
+
+	n->pos = 0;
+	for (i = 0; i < 2; i++)
+		var += (n->sum_sqr[i] - n->sum[i]*n->sum[i]/NOISE_WINDOW) / NOISE_WINDOW;
+	d->noise_sigma = sqrt(var);
+	d->noise_threshold = NOISE_THRESH_FACTOR * d->noise_sigma / VELOC_ADJUST;
+	if (d->noise_threshold > NOISE_MAX_FACTOR * d->base_threshold)
+		d->noise_threshold = NOISE_MAX_FACTOR * d->base_threshold;
+	noise_clip(d);
+}
+
+/*
+ * adapt_threshold() - adaptive threshold adjustment, shared by both kernels
+ */
+static void adapt_threshold (struct detector *d, double unow)
+{
+	double base_threshold = d->base_threshold;
+	int recently_near_thresh;
+
+	if (d->auto_threshold && d->noise_threshold > base_threshold)
+		base_threshold = d->noise_threshold;
+	if (!d->adaptive || d->adaptive_threshold < base_threshold)
+		d->adaptive_threshold = base_threshold; /* reconfigured, or noise */
+	recently_near_thresh = unow < d->last_near_thresh + RECENT_PARK_SEC;
+	if (d->adaptive && recently_near_thresh &&
+	    d->km_activity && d->km_activity())
+		d->last_km_activity = unow;
+	if (d->adaptive && unow > d->last_thresh_change + THRESH_ADAPT_SEC) {
+		if (recently_near_thresh) {
+			if (d->last_km_activity > d->last_near_thresh &&
+			    d->last_km_activity > d->last_thresh_change) {
+				/* Near threshold and k/m activity */
+				d->adaptive_threshold *= d->params.thresh_increase_factor;
+				d->last_thresh_change = unow;
+			}
+		} else {
+			/* Recently never near threshold */
+			d->adaptive_threshold *= d->params.thresh_decrease_factor;
+			if (d->adaptive_threshold < base_threshold)
+				d->adaptive_threshold = base_threshold;
+			d->last_thresh_change = unow;
+		}
+	}
+}
+
+/*
+ * print_sample() - the verbose per-sample line, shared by both kernels
+ */
+static void print_sample (double udelta, int x_delta, int y_delta,
+                          double x_veloc, double y_veloc,
+                          double x_accel, double y_accel,
+                          double x_avg_veloc, double y_avg_veloc,
+                          double g, double threshold, const char *reason)
+{
+	printf("dt=%5.3f  "
+	       "dpos=(%3d,%3d)  "
+	       "vel=(%6.1f,%6.1f)*%g  "
+	       "acc=(%6.1f,%6.1f)*%g  "
+	       "avg_vel=(%6.1f,%6.1f)*%g  "
+	       "g=%4.2f  "
+	       "thr=%.1f  "
+	       "%s\n",
+	       udelta,
+	       x_delta, y_delta,
+	       x_veloc/VELOC_ADJUST,
+	       y_veloc/VELOC_ADJUST,
+	       VELOC_ADJUST*1.0,
+	       x_accel/ACCEL_ADJUST,
+	       y_accel/ACCEL_ADJUST,
+	       ACCEL_ADJUST*1.0,
+	       x_avg_veloc/AVG_VELOC_ADJUST,
+	       y_avg_veloc/AVG_VELOC_ADJUST,
+	       AVG_VELOC_ADJUST*1.0,
+	       g,
+	       threshold,
+	       reason);
+}
+
+/*
+ * freefall_depth() - how far |a| fell below 1 g, as a fraction of 1 g.
+ * A device in free fall measures (close to) 0 g on all axes, long before
+ * the impact shows up as velocity or acceleration on x and y. Since the
+ * scale of the sensors differs, 1 g is learned from the magnitude while the
+ * device rests; until that estimate settled we report nothing.
+ */
+static double freefall_depth (struct detector *d, int x, int y, int z,
+                              double udelta)
+{
+	double mag, weight;
+
+	mag = sqrt((double)x*x + (double)y*y + (double)z*z);
+	if (fabs(mag - d->g_ref) <= d->g_ref*GREF_STABLE_FACTOR) {
+		weight = udelta/GREF_DEPTH_SEC;
+		weight = 1 - 1.0/(1+weight); /* softly clamped to 1 */
+		d->g_ref = weight*mag + (1-weight)*d->g_ref;
+		d->g_settled += udelta;
+	} else if (d->g_settled < GREF_SETTLE_SEC) {
+		/* not settled yet, start over from here */
+		d->g_ref = mag;
+		d->g_settled = 0;
+	}
+
+	if (d->g_settled < GREF_SETTLE_SEC || d->g_ref <= 0)
+		return 0;
+	return 1 - mag/d->g_ref;
+}
+
+/*
+ * detector_step_double() - make a decision on whether to park given present
+ *                          readouts (remembers some past data in the detector).
+ * Computes and checks 3 values:
+ *   velocity:     current position - prev position / time delta
+ *   acceleration: current velocity - prev velocity / time delta
+ *   average velocity: exponentially decaying average of velocity,
+ *                     weighed by time delta.
+ * The velocity and acceleration tests respond quickly to short sharp shocks,
+ * while the average velocity test catches long, smooth movements (and
+ * averages out measurement noise).
+ * The adaptive threshold, if enabled, increases when (built-in) keyboard or
+ * mouse activity happens shortly after some value was above or near the
+ * adaptive threshold. The adaptive threshold slowly decreases back to the
+ * base threshold when no value approaches it.
+ * With three axes, a drop of the total acceleration towards 0 g for
+ * FREEFALL_SAMPLES samples is taken as free fall and parks as well.
+ */
+int detector_step_double (struct detector *d, int x, int y, int z,
+                          double unow, int parked)
+{
+	double udelta, x_delta, y_delta, x_veloc, y_veloc, x_accel, y_accel;
+	double veloc_sqr, accel_sqr, avg_veloc_sqr;
+	double exp_weight, fall_depth = 0;
+	double threshold; /* transient threshold for this iteration */
+	double nf = d->params.near_thresh_factor;
+	char reason[5]; /* "which threshold reached?" string for verbose */
+	char *r = d->verbose ? reason : NULL;
+	int above = 0, near = 0; /* above threshold, near threshold */
+	int falling = 0;
+
+	adapt_threshold(d, unow);
+
+	/* compute deltas */
+	udelta = unow - d->unow_last;
+	x_delta = x - d->x_last;
+	y_delta = y - d->y_last;
+
+	/* compute velocity */
+	x_veloc = x_delta/udelta;
+	y_veloc = y_delta/udelta;
+	veloc_sqr = x_veloc*x_veloc + y_veloc*y_veloc;
+
+	/* compute acceleration */
+	x_accel = (x_veloc - d->x_veloc_last)/udelta;
+	y_accel = (y_veloc - d->y_veloc_last)/udelta;
+	accel_sqr = x_accel*x_accel + y_accel*y_accel;
+
+	/* compute exponentially-decaying velocity average */
+	exp_weight = udelta/d->params.avg_depth_sec; /* weight of this sample */
+	exp_weight = 1 - 1.0/(1+exp_weight); /* softly clamped to 1 */
+	d->x_avg_veloc = exp_weight*x_veloc + (1-exp_weight)*d->x_avg_veloc;
+	d->y_avg_veloc = exp_weight*y_veloc + (1-exp_weight)*d->y_avg_veloc;
+	avg_veloc_sqr = d->x_avg_veloc*d->x_avg_veloc + d->y_avg_veloc*d->y_avg_veloc;
+
+	if (d->three_axis)
+		fall_depth = freefall_depth(d, x, y, z, udelta);
+
+	threshold = d->adaptive_threshold;
+	if (parked) /* when parked, be reluctant to unpark */
+		threshold *= d->params.parked_thresh_factor;
+
+	/* Threshold test (uses Pythagoras's theorem) */
+	if (r)
+		strncpy(reason, "    ", 5);
+
+	check_thresh(veloc_sqr, threshold*VELOC_ADJUST, nf,
+	             &above, &near, r ? r+0 : NULL, 'V');
+	check_thresh(accel_sqr, threshold*ACCEL_ADJUST, nf,
+	             &above, &near, r ? r+1 : NULL, 'A');
+	check_thresh(avg_veloc_sqr, threshold*AVG_VELOC_ADJUST, nf,
+	             &above, &near, r ? r+2 : NULL, 'X');
+	if (d->three_axis && fall_depth > 0)
+		check_thresh(fall_depth*fall_depth,
+		             (1-FREEFALL_FACTOR) * (parked ? d->params.parked_thresh_factor : 1),
+		             nf, &falling, &near, r ? r+3 : NULL, 'F');
+	d->low_samples = falling ? d->low_samples+1 : 0;
+	if (d->low_samples >= FREEFALL_SAMPLES)
+		above = 1;
+	else if (falling && r)
+		reason[3] = 'f';
+
+	if (r)
+		print_sample(udelta, x - d->x_last, y - d->y_last, x_veloc, y_veloc,
+		             x_accel, y_accel, d->x_avg_veloc, d->y_avg_veloc,
+		             1 - fall_depth, threshold, reason);
+
+	/* track the noise, also while parked: it may be what keeps us parked */
+	if (d->auto_threshold && d->history >= 2 && udelta <= 1.0 &&
+	    fabs(x_veloc) < NOISE_VELOC_MAX && fabs(y_veloc) < NOISE_VELOC_MAX)
+		noise_add(d, x_veloc, y_veloc);
+
+	if (udelta>1.0) { /* Too much time since last (resume from suspend?) */
+		d->history = 0;
+		d->x_avg_veloc = d->y_avg_veloc = 0;
+	}
+
+	if (d->history<2) { /* Not enough data for meaningful result */
+		above = 0;
+		near = 0;
+		++d->history;
+	}
+
+	if (near)
+		d->last_near_thresh = unow;
+	d->near = near;
+
+	d->x_last = x;
+	d->y_last = y;
+	d->x_veloc_last = x_veloc;
+	d->y_veloc_last = y_veloc;
+	d->unow_last = unow;
+
+	return above;
+}
+
+/*
+ * Fixed-point kernel. Velocities and accelerations are in sensor units per
+ * second (per second) with FX_SHIFT fractional bits, weights and factors
+ * have 16 fractional bits and time deltas are in microseconds. The tuning
+ * constants are folded in here at compile time, the squared thresholds are
+ * only recomputed when the threshold changes.
+ */
+#define FX_SHIFT		8
+#define FX_ONE			(1 << FX_SHIFT)
+#define FX_Q16(v)		((int64_t)((v)*65536 + 0.5))
+#define FX_USEC			1000000
+#define FX_VALUE_MAX		((int64_t)1 << 40)	/* keeps products in range */
+#define FX_LIMIT_MAX		(((int64_t)1 << 31) - 1)	/* 2*lim^2 stays below 2^63 */
+#define FX_AVG_DEPTH_USEC	((int64_t)(AVG_DEPTH_SEC * FX_USEC))
+#define FX_GREF_DEPTH_USEC	((int64_t)(GREF_DEPTH_SEC * FX_USEC))
+#define FX_GREF_SETTLE_USEC	((int64_t)(GREF_SETTLE_SEC * FX_USEC))
+#define FX_GREF_LOW		FX_Q16((1-GREF_STABLE_FACTOR) * (1-GREF_STABLE_FACTOR))
+#define FX_GREF_HIGH		FX_Q16((1+GREF_STABLE_FACTOR) * (1+GREF_STABLE_FACTOR))
+/* |a|^2 below this fraction of 1 g^2 means falling (near/above, parked) */
+#define FX_FALL(f)		FX_Q16((1-(1-FREEFALL_FACTOR)*(f)) * (1-(1-FREEFALL_FACTOR)*(f)))
+
+static const int64_t fx_fall[2][2] = {
+	{ FX_FALL(NEAR_THRESH_FACTOR), FX_FALL(1) },
+	{ FX_FALL(NEAR_THRESH_FACTOR*PARKED_THRESH_FACTOR), FX_FALL(PARKED_THRESH_FACTOR) },
+};
+
+static int64_t fx_clamp (int64_t v)
+{
+	if (v > FX_VALUE_MAX)
+		return FX_VALUE_MAX;
+	if (v < -FX_VALUE_MAX)
+		return -FX_VALUE_MAX;
+	return v;
+}
+
+/* weight of a sample dt us long in an average over depth us, softly clamped */
+static int64_t fx_weight (int64_t dt, int64_t depth)
+{
+	if (dt > 1000*depth)
+		return 65536;
+	return (dt << 16) / (dt + depth);
+}
+
+/*
+ * fx_limits() - precompute the limits for a threshold
+ */
+static void fx_limits (struct detector_fixed *f, double threshold)
+{
+	const double adjust[3] = { VELOC_ADJUST, ACCEL_ADJUST, AVG_VELOC_ADJUST };
+	double t;
+	int i;
+
+	f->thresh = threshold;
+	for (i = 0; i < 3; i++) {
+		t = threshold * adjust[i] * FX_ONE;
+		if (t > FX_LIMIT_MAX)
+			t = FX_LIMIT_MAX;
+		f->lim[i] = t;
+		f->sqr[i][0] = t*t*NEAR_THRESH_FACTOR*NEAR_THRESH_FACTOR;
+		f->sqr[i][1] = t*t;
+	}
+}
+
+/*
+ * fx_check() - fixed-point check_thresh() for a 2D vector against limit i
+ */
+static void fx_check (const struct detector_fixed *f, int i,
+                      int64_t vx, int64_t vy, int *above, int *near,
+                      char *reason_out, char reason_mark)
+{
+	int64_t val_sqr;
+
+	/* one component alone is over the limit, and squaring might overflow */
+	if (vx > f->lim[i] || vx < -f->lim[i] || vy > f->lim[i] || vy < -f->lim[i]) {
+		*above = *near = 1;
+		if (reason_out)
+			*reason_out = toupper(reason_mark);
+		return;
+	}
+	val_sqr = vx*vx + vy*vy;
+	if (val_sqr > f->sqr[i][0]) {
+		*near = 1;
+		if (reason_out)
+			*reason_out = tolower(reason_mark);
+	}
+	if (val_sqr > f->sqr[i][1]) {
+		*above = 1;
+		if (reason_out)
+			*reason_out = toupper(reason_mark);
+	}
+}
+
+/*
+ * fx_freefall() - fixed-point freefall_depth(), working on |a|^2. Returns
+ * |a|^2 with FX_SHIFT fractional bits, or -1 while 1 g is not known.
+ */
+static int64_t fx_freefall (struct detector *d, int x, int y, int z, int64_t dt)
+{
+	struct detector_fixed *f = &d->fx;
+	int64_t mag_sqr, w;
+
+	mag_sqr = ((int64_t)x*x + (int64_t)y*y + (int64_t)z*z) << FX_SHIFT;
+	if (mag_sqr >= (f->g_ref_sqr * FX_GREF_LOW >> 16) &&
+	    mag_sqr <= (f->g_ref_sqr * FX_GREF_HIGH >> 16)) {
+		w = fx_weight(dt, FX_GREF_DEPTH_USEC);
+		f->g_ref_sqr = (w*mag_sqr + (65536-w)*f->g_ref_sqr) >> 16;
+		if (f->g_settled < FX_GREF_SETTLE_USEC)
+			f->g_settled += dt;
+	} else if (f->g_settled < FX_GREF_SETTLE_USEC) {
+		/* not settled yet, start over from here */
+		f->g_ref_sqr = mag_sqr;
+		f->g_settled = 0;
+	}
+
+	if (f->g_settled < FX_GREF_SETTLE_USEC || f->g_ref_sqr <= 0)
+		return -1;
+	return mag_sqr;
+}
+
+/*
+ * detector_step_fixed() - detector_step_double() in integer arithmetic, for
+ * CPUs without a (fast) FPU. Only the time delta and the adaptive threshold,
+ * which changes at most once per THRESH_ADAPT_SEC, are handled as doubles.
+ * Decisions match the double kernel except for rounding right at a threshold.
+ */
+int detector_step_fixed (struct detector *d, int x, int y, int z,
+                         double unow, int parked)
+{
+	struct detector_fixed *f = &d->fx;
+	int64_t dt, w, x_veloc, y_veloc, x_accel, y_accel, mag_sqr = -1;
+	double threshold;
+	char reason[5]; /* "which threshold reached?" string for verbose */
+	char *r = d->verbose ? reason : NULL;
+	int above = 0, near = 0, falling = 0;
+
+	adapt_threshold(d, unow);
+
+	dt = (unow - d->unow_last) * FX_USEC + 0.5;
+	if (dt < 1)
+		dt = 1;
+
+	x_veloc = fx_clamp(((int64_t)(x - d->x_last) << FX_SHIFT) * FX_USEC / dt);
+	y_veloc = fx_clamp(((int64_t)(y - d->y_last) << FX_SHIFT) * FX_USEC / dt);
+	x_accel = fx_clamp((x_veloc - f->x_veloc_last) * FX_USEC / dt);
+	y_accel = fx_clamp((y_veloc - f->y_veloc_last) * FX_USEC / dt);
+
+	w = fx_weight(dt, FX_AVG_DEPTH_USEC);
+	f->x_avg_veloc = (w*x_veloc + (65536-w)*f->x_avg_veloc) >> 16;
+	f->y_avg_veloc = (w*y_veloc + (65536-w)*f->y_avg_veloc) >> 16;
+
+	if (d->three_axis)
+		mag_sqr = fx_freefall(d, x, y, z, dt);
+
+	threshold = d->adaptive_threshold;
+	if (parked) /* when parked, be reluctant to unpark */
+		threshold *= PARKED_THRESH_FACTOR;
+	if (threshold != f->thresh)
+		fx_limits(f, threshold);
+
+	if (r)
+		strncpy(reason, "    ", 5);
+	fx_check(f, 0, x_veloc, y_veloc, &above, &near, r ? r+0 : NULL, 'V');
+	fx_check(f, 1, x_accel, y_accel, &above, &near, r ? r+1 : NULL, 'A');
+	fx_check(f, 2, f->x_avg_veloc, f->y_avg_veloc, &above, &near,
+	         r ? r+2 : NULL, 'X');
+	if (mag_sqr >= 0) {
+		if (mag_sqr < (f->g_ref_sqr * fx_fall[!!parked][0] >> 16)) {
+			near = 1;
+			if (r)
+				r[3] = 'f';
+		}
+		if (mag_sqr < (f->g_ref_sqr * fx_fall[!!parked][1] >> 16)) {
+			falling = 1;
+			if (r)
+				r[3] = 'F';
+		}
+	}
+	d->low_samples = falling ? d->low_samples+1 : 0;
+	if (d->low_samples >= FREEFALL_SAMPLES)
+		above = 1;
+	else if (falling && r)
+		reason[3] = 'f';
+
+	if (r)
+		print_sample(dt / (double)FX_USEC, x - d->x_last, y - d->y_last,
+		             (double)x_veloc / FX_ONE, (double)y_veloc / FX_ONE,
+		             (double)x_accel / FX_ONE, (double)y_accel / FX_ONE,
+		             (double)f->x_avg_veloc / FX_ONE,
+		             (double)f->y_avg_veloc / FX_ONE,
+		             mag_sqr >= 0 ? sqrt((double)mag_sqr / f->g_ref_sqr) : 1,
+		             threshold, reason);
+
+	/* track the noise, also while parked: it may be what keeps us parked */
+	if (d->auto_threshold && d->history >= 2 && dt <= FX_USEC)
+		noise_add(d, x_veloc >> FX_SHIFT, y_veloc >> FX_SHIFT);
+
+	if (dt > FX_USEC) { /* Too much time since last (resume from suspend?) */
+		d->history = 0;
+		f->x_avg_veloc = f->y_avg_veloc = 0;
+	}
+
+	if (d->history<2) { /* Not enough data for meaningful result */
+		above = 0;
+		near = 0;
+		++d->history;
+	}
+
+	if (near)
+		d->last_near_thresh = unow;
+	d->near = near;
+
+	d->x_last = x;
+	d->y_last = y;
+	f->x_veloc_last = x_veloc;
+	f->y_veloc_last = y_veloc;
+	d->unow_last = unow;
+
+	return above;
+}
+
+/*
+ * predict_crossing() - fit a line through the PREDICT_DEPTH velocities and
+ * tell whether it crosses limit at time horizon. The last
+ * point has to be at PREDICT_FACTOR of the limit already, and the line has
+ * to explain the points: extrapolating noise or a single shock would park
+ * all the time.
+ */
+static int predict_crossing (const double *t, const double *vx,
+                             const double *vy, int last, double horizon,
+                             double limit)
+{
+	double tm = 0, vxm = 0, vym = 0, stt = 0, stx = 0, sty = 0;
+	double ex, ey, ss_res = 0, ss_tot = 0, px, py;
+	int i;
+
+	if (vx[last]*vx[last] + vy[last]*vy[last] <
+	    PREDICT_FACTOR*PREDICT_FACTOR*limit*limit)
+		return 0;
+
+	for (i = 0; i < PREDICT_DEPTH; i++) {
+		tm += t[i];
+		vxm += vx[i];
+		vym += vy[i];
+	}
+	tm /= PREDICT_DEPTH;
+	vxm /= PREDICT_DEPTH;
+	vym /= PREDICT_DEPTH;
+	for (i = 0; i < PREDICT_DEPTH; i++) {
+		stt += (t[i] - tm) * (t[i] - tm);
+		stx += (t[i] - tm) * (vx[i] - vxm);
+		sty += (t[i] - tm) * (vy[i] - vym);
+	}
+	if (stt <= 0)
+		return 0;
+
+	for (i = 0; i < PREDICT_DEPTH; i++) {
+		ex = vx[i] - vxm - stx/stt * (t[i] - tm);
+		ey = vy[i] - vym - sty/stt * (t[i] - tm);
+		ss_res += ex*ex + ey*ey;
+		ss_tot += (vx[i] - vxm) * (vx[i] - vxm) +
+		          (vy[i] - vym) * (vy[i] - vym);
+	}
+	if (ss_res > (1 - PREDICT_MIN_FIT) * ss_tot)
+		return 0;
+
+	px = vxm + stx/stt * (horizon - tm);
+	py = vym + sty/stt * (horizon - tm);
+	return px*px + py*py > limit*limit &&
+	       px*px + py*py > vx[last]*vx[last] + vy[last]*vy[last];
+}
+
+/*
+ * detector_predict() - the predictive stage, run after a kernel which
+ * decided above. Projects the velocity PREDICT_AHEAD sample periods ahead;
+ * if it crosses its threshold before the kernel sees it, the disks are
+ * parked early and d->speculative tells such decisions apart. Slow movements
+ * are left to the velocity average, which is smooth enough to extrapolate
+ * the sway of walking into false parks.
+ *
+ * A predicted park counts as confirmed if the velocity really crosses the
+ * (unparked) threshold within the projected time plus one period. Parking
+ * lowers the threshold, so the kernel's own decisions can't tell.
+ */
+int detector_predict (struct detector *d, int x, int y, double unow,
+                      int parked, int above)
+{
+	struct predictor *p = &d->pred;
+	double udelta = unow - p->unow_last;
+	double limit = d->adaptive_threshold * VELOC_ADJUST;
+	double vx, vy;
+	int last;
+
+	d->speculative = 0;
+	if (udelta <= 0 || udelta > 1.0 || p->unow_last == 0) {
+		p->count = 0; /* no usable velocity (resume from suspend?) */
+		p->pending = 0;
+		goto out;
+	}
+	vx = (x - p->x_last) / udelta;
+	vy = (y - p->y_last) / udelta;
+
+	if (p->pending) {
+		if (vx*vx + vy*vy > limit*limit) {
+			p->confirmed++;
+			p->pending = 0;
+		} else if (unow > p->pending) {
+			p->pending = 0;
+		}
+	}
+
+	p->t[p->pos] = unow;
+	p->vx[p->pos] = vx;
+	p->vy[p->pos] = vy;
+	last = p->pos;
+	p->pos = (p->pos + 1) % PREDICT_DEPTH;
+	if (p->count < PREDICT_DEPTH)
+		p->count++;
+	if (above || p->count < PREDICT_DEPTH)
+		goto out;
+
+	if (predict_crossing(p->t, p->vx, p->vy, last,
+	                     unow + PREDICT_AHEAD*udelta, limit)) {
+		d->speculative = 1;
+		if (!parked && !p->pending) {
+			p->parks++;
+			p->pending = unow + (PREDICT_AHEAD+1)*udelta;
+		}
+		if (d->verbose)
+			printf("predicted crossing in %d samples\n", PREDICT_AHEAD);
+	}
+
+out:
+	p->x_last = x;
+	p->y_last = y;
+	p->unow_last = unow;
+	return above || d->speculative;
+}
+
+/*
+ * detector_step() - feed one sample to the kernel selected at build time,
+ * and to the predictor if enabled; returns 1 if the disks should be parked
+ */
+int detector_step (struct detector *d, int x, int y, int z, double unow,
+                   int parked)
+{
+	int above;
+
+#ifdef DETECTOR_FIXED_POINT
+	above = detector_step_fixed(d, x, y, z, unow, parked);
+#else
+	above = detector_step_double(d, x, y, z, unow, parked);
+#endif
+	if (!d->predict)
+		return above;
+	return detector_predict(d, x, y, unow, parked, above);
+}
@@ -0,0 +1,166 @@
+#include <stdint.h>
+
+/* Magic threshold tweak factors, determined experimentally to make a
+ * threshold of 10-20 behave reasonably.
+ */
+#define VELOC_ADJUST            30.0
+#define ACCEL_ADJUST            (VELOC_ADJUST * 60)
+#define AVG_VELOC_ADJUST        3.0
+
+/* History depth for velocity average, in seconds */
+#define AVG_DEPTH_SEC           0.3
+
+/* Parameters for adaptive threshold */
+#define RECENT_PARK_SEC        3.0    /* How recent is "recently parked"? */
+#define THRESH_ADAPT_SEC       1.0    /* How often to (potentially) change
+                                       * the adaptive threshold?           */
+#define THRESH_INCREASE_FACTOR 1.1    /* Increase factor when recently
+                                       * parked but user is typing      */
+#define THRESH_DECREASE_FACTOR 0.9985 /* Decrease factor when not recently
+                                       * parked, per THRESH_ADAPT_SEC sec. */
+#define NEAR_THRESH_FACTOR     0.8    /* Fraction of threshold considered
+                                       * being near the threshold.       */
+
+/* Threshold for *continued* parking, as fraction of normal threshold */
+#define PARKED_THRESH_FACTOR   NEAR_THRESH_FACTOR /* >= NEAR_THRESH_FACTOR */
+
+/* Parameters for three-axis free-fall detection */
+#define FREEFALL_FACTOR        0.4    /* |a| below this fraction of 1 g
+                                       * means falling...                */
+#define FREEFALL_SAMPLES       2      /* ...for this many samples in a row */
+#define GREF_DEPTH_SEC         2.0    /* History depth for the 1 g estimate */
+#define GREF_STABLE_FACTOR     0.1    /* |a| within this fraction of 1 g
+                                       * counts as resting                */
+#define GREF_SETTLE_SEC        0.5    /* Resting time before the 1 g
+                                       * estimate is trusted              */
+
+/* Parameters for the automatic threshold (noise floor estimation) */
+#define NOISE_WINDOW           256    /* Samples in the noise estimate */
+#define NOISE_THRESH_FACTOR    5.0    /* Velocity threshold in multiples of
+                                       * the velocity noise (std. dev.)   */
+#define NOISE_MAX_FACTOR       3.0    /* Noise raises the threshold to at
+                                       * most this multiple of -s         */
+#define NOISE_CLIP_FACTOR      3.0    /* Velocities are clipped to this
+                                       * multiple of the noise, so shocks
+                                       * barely move the estimate        */
+#define NOISE_VELOC_MAX        (1 << 20) /* Clamp for velocities, so that
+                                          * the sums fit in 64 bits      */
+
+/* Parameters for predictive parking */
+#define PREDICT_DEPTH          4      /* Samples in the velocity trend fit */
+#define PREDICT_AHEAD          3      /* Sample periods projected ahead */
+#define PREDICT_FACTOR         0.5    /* Fraction of the velocity threshold
+                                       * from which on we extrapolate   */
+#define PREDICT_MIN_FIT        0.8    /* Least R^2 of the trend line */
+
+/*
+ * Windowed estimate of the per-axis velocity noise: a ring buffer of the
+ * last NOISE_WINDOW (clipped) velocities in units/s and their running sums.
+ */
+struct noise_estimate {
+	int32_t veloc[NOISE_WINDOW][2];
+	int pos, count;
+	int64_t sum[2], sum_sqr[2];
+	int64_t clip;			/* current clipping limit */
+};
+
+/*
+ * Predictor state: the last PREDICT_DEPTH velocities (units/s) in a ring,
+ * and the bookkeeping for the precision of the predicted parks.
+ */
+struct predictor {
+	int x_last, y_last;
+	double unow_last;
+	double t[PREDICT_DEPTH], vx[PREDICT_DEPTH], vy[PREDICT_DEPTH];
+	int pos, count;
+	double pending;			/* predicted crossing due until, or 0 */
+	unsigned long parks;		/* parks issued by the predictor */
+	unsigned long confirmed;	/* ...followed by the real crossing */
+};
+
+/*
+ * Tuning parameters, initialised from the constants above by detector_init().
+ * The fixed-point kernel has near_thresh_factor, parked_thresh_factor and
+ * avg_depth_sec compiled in and ignores changes to them.
+ */
+struct detector_params {
+	double near_thresh_factor;
+	double parked_thresh_factor;	/* >= near_thresh_factor */
+	double thresh_increase_factor;
+	double thresh_decrease_factor;
+	double avg_depth_sec;
+};
+
+/*
+ * State of the fixed-point kernel, in the units described in detector.c
+ */
+struct detector_fixed {
+	int64_t x_veloc_last, y_veloc_last;
+	int64_t x_avg_veloc, y_avg_veloc;
+	int64_t g_ref_sqr;		/* |a|^2 at rest */
+	int64_t g_settled;		/* us spent resting at g_ref */
+	double thresh;			/* threshold the limits are for */
+	int64_t lim[3];			/* velocity, accel, avg velocity */
+	int64_t sqr[3][2];		/* squared limits, near and above */
+};
+
+/*
+ * State of one detector. The daemon uses a single one, offline tools can
+ * run as many as they like side by side.
+ */
+struct detector {
+	/* configuration, may be changed between steps */
+	double base_threshold;
+	int adaptive;
+	int verbose;			/* print per-sample statistics */
+	int (*km_activity)(void);	/* built-in keyboard/mouse used? polled
+					   near the threshold, if there is no
+					   detector_km_activity() source */
+	int three_axis;			/* z is valid, detect free fall */
+	int auto_threshold;		/* raise the threshold above the noise */
+	int predict;			/* park early on a predicted crossing */
+	struct detector_params params;
+
+	/* state of the previous sample */
+	int x_last, y_last;
+	double unow_last, x_veloc_last, y_veloc_last;
+	double x_avg_veloc, y_avg_veloc;
+	int history;			/* how many recent valid samples? */
+	int near;			/* last sample near or above thresh */
+
+	/* adaptive threshold */
+	double adaptive_threshold;	/* current adaptive thresh */
+	double last_thresh_change;	/* last adaptive thresh change */
+	double last_near_thresh;	/* last time we were near thresh */
+	double last_km_activity;	/* last time kbd/mouse activity seen */
+
+	/* free fall */
+	double g_ref;			/* |a| at rest, in sensor units */
+	double g_settled;		/* time spent resting at g_ref */
+	int low_samples;		/* samples in a row with |a| low */
+
+	/* automatic threshold, updated once per NOISE_WINDOW samples */
+	struct noise_estimate noise;
+	double noise_sigma;		/* velocity noise, units/s, 0: unknown */
+	double noise_threshold;		/* threshold derived from it */
+
+	/* predictive parking */
+	struct predictor pred;
+	int speculative;		/* last park decision was predicted */
+
+	struct detector_fixed fx;
+};
+
+void check_thresh(double val_sqr, double thresh, double near_factor,
+                  int* above, int* near, char* reason_out, char reason_mark);
+void detector_init(struct detector *d, double base_threshold, int adaptive);
+void detector_reset(struct detector *d);
+void detector_km_activity(struct detector *d, double unow);
+int detector_step(struct detector *d, int x, int y, int z, double unow,
+                  int parked);
+int detector_step_double(struct detector *d, int x, int y, int z,
+                         double unow, int parked);
+int detector_step_fixed(struct detector *d, int x, int y, int z,
+                        double unow, int parked);
+int detector_predict(struct detector *d, int x, int y, double unow,
+                     int parked, int above);
@@ -31,6 +31,11 @@
 #include "config.h"
 #include "hdapsd.h"
 #include "input-helper.h"
+#include "sysfs-helper.h"
+#include "trace.h"
+#include "detector.h"
+#include "uevent.h"
+#include "control.h"
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,17 +43,30 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
 #include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 #include <errno.h>
 #include <ctype.h>
 #include <sys/utsname.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <getopt.h>
 #include <linux/input.h>
 #include <linux/version.h>
 #include <syslog.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 #ifdef HAVE_LIBCONFIG
 # include <libconfig.h>
@@ -63,8 +81,8 @@
 # define input_event_usec time.tv_usec
 #endif
 
-static volatile int pause_now = 0;
-static volatile int running = 1;
+static int paused = 0;
+static int running = 1;
 static int verbose = 0;
 static int dry_run = 0;
 static int poll_sysfs = 0;
@@ -75,13 +93,69 @@ static int background = 0;
 static int dosyslog = 0;
 static int forcerotational = 0;
 static int use_leds = 1;
+static int sysfs_reopen = 0;
+static struct sysfs_attr position_attr = SYSFS_ATTR_INIT(NULL);
+static struct sysfs_attr toshiba_attr = SYSFS_ATTR_INIT(TOSHIBA_MOVEMENT_FILE);
+static int toshiba_notified = 0;	/* the driver uses sysfs_notify() */
+static int toshiba_level = -1;		/* protection level to restore, or -1 */
+static int toshiba_level_fd = -1;
+static int parked = 0;
+static double parked_utime = 0;
+static int led_fd = -1;
+static FILE *trace_file = NULL;
+static struct sampling_clock sampling;
+static struct rate_control rate;
+static struct fall_stats fall;
+static struct run_stats stats;
+static char control_path[FILENAME_MAX] = "";	/* -C, empty if none */
+static struct input_recovery input_rec;
+static int disks_autodetected = 0;
+static char wanted_disks[MAX_DISKS][BUF_LEN]; /* given with -d or in the config */
+static int num_wanted_disks = 0;
+static int startup_profile = 0;
+static struct startup_phase startup[MAX_STARTUP_PHASES];
+static int num_startup_phases = 0;
+static int startup_fds[2] = { -1, -1 };	/* inotify and uevents while waiting */
+static struct detector detector;
+
+/* park latency, per stage */
+static struct latency_hist latency_decide = { .name = "sample to decision" };
+static struct latency_hist latency_actuate = { .name = "decision to parked" };
+static struct latency_hist latency_total = { .name = "sample to parked" };
 
 char pid_file[FILENAME_MAX] = "";
 int hdaps_input_fd = 0;
 int hdaps_input_nr = -1;
+unsigned long input_drops = 0;	/* SYN_DROPPED seen on the input device */
 int freefall_fd = -1;
-
-struct list *disklist = NULL;
+int km_fds[MAX_KM_DEVICES];	/* built-in keyboard and pointing devices */
+int num_km_fds = 0;
+
+/* main loop: one epoll set for the sensor, signals and all deadlines */
+int epoll_fd = -1;
+int signal_fd = -1;
+int sample_timer_fd = -1;	/* next sysfs/hardware-logic poll */
+int unpark_timer_fd = -1;	/* freeze expiry */
+int pause_timer_fd = -1;	/* end of SIGUSR1 pause */
+int fall_timer_fd = -1;		/* end of a fall reported by /dev/freefall */
+int input_retry_timer_fd = -1;	/* next search for a lost input device */
+int input_watch_fd = -1;	/* inotify on /dev/input, for its return */
+int uevent_fd = -1;		/* kernel uevents, for disk hotplug */
+int control_fd = -1;		/* listening control socket */
+
+struct disk disks[MAX_DISKS];
+int num_disks = 0;
+
+/* park workers: one thread per disk, so all disks are protected at once */
+struct park_worker *park_workers = NULL;
+int park_worker_count = 0;
+pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t park_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t park_done = PTHREAD_COND_INITIALIZER;
+unsigned long park_generation = 0;	/* bumped for every job */
+int park_value = 0;			/* value to write for the job */
+int park_pending = 0;			/* workers still busy with the job */
+int park_quit = 0;
 enum kernel kernel_interface = UNLOAD_HEADS;
 enum interfaces position_interface = INTERFACE_NONE;
 
@@ -92,6 +166,7 @@ enum interfaces position_interface = INTERFACE_NONE;
 void printlog (FILE *stream, const char *fmt, ...)
 {
 	time_t now;
+	char timestr[26];
 	int len = sizeof(fmt);
 
 	char msg[len+1024];
@@ -104,21 +179,16 @@ void printlog (FILE *stream, const char *fmt, ...)
 	        syslog(LOG_INFO, "%s", msg);
 	else {
 		now = time((time_t *)NULL);
-		fprintf(stream, "%.24s: %s\n", ctime(&now), msg);
+		fprintf(stream, "%.24s: %s\n", ctime_r(&now, timestr), msg);
 	}
 }
 
 /*
  * slurp_file - read the content of a file (up to BUF_LEN-1) into a string.
  *
- * We open and close the file on every invocation, which is lame but due to
- * several features of sysfs files:
- *
- *	(a) Sysfs files are seekable.
- *	(b) Seeking to zero and then rereading does not seem to work.
- *
- * If I were king--and I will be one day--I would have made sysfs files
- * nonseekable and only able to return full-size reads.
+ * We open and close the file on every invocation. This is fine for one-shot
+ * reads; the position files, which are read on every sample, go through
+ * read_position_file() instead.
  */
 static int slurp_file (const char* filename, char* buf)
 {
@@ -143,6 +213,34 @@ static int slurp_file (const char* filename, char* buf)
 	return ret;
 }
 
+/*
+ * read_position_file() - read the content of a position file into a string.
+ *
+ * The file is opened on the first call and kept open; every further sample
+ * costs a single pread() at offset 0 instead of open/read/close, unless the
+ * kernel is too old to refresh sysfs attributes that way (see sysfs_reopen).
+ * After an error the file is closed and reopened on the next call.
+ */
+static int read_position_file (const char* filename, char* buf)
+{
+	int ret;
+
+	if (position_attr.path != filename) {
+		sysfs_attr_close(&position_attr);
+		position_attr.path = filename;
+		position_attr.reopen = sysfs_reopen;
+	}
+
+	ret = sysfs_attr_read(&position_attr, buf, BUF_LEN);
+	if (ret < 0) {
+		printlog(stderr, "Could not read from %s: %s.\nDo you have the hdaps module loaded?", filename, strerror(-ret));
+		sysfs_attr_close(&position_attr);
+		errno = -ret;
+		return ret;
+	}
+	return 0;
+}
+
 /*
  * read_position_from_hdaps() - read the (x,y) position pair from hdaps via sysfs files
  * This method is not recommended for frequent polling, since it causes unnecessary interrupts
@@ -151,22 +249,41 @@ static int slurp_file (const char* filename, char* buf)
 static int read_position_from_hdaps (int *x, int *y)
 {
 	char buf[BUF_LEN];
-	int ret;
-	if ((ret = slurp_file(HDAPS_POSITION_FILE, buf)))
+	int ret, val[2];
+	if ((ret = read_position_file(HDAPS_POSITION_FILE, buf)))
 		return ret;
-	return (sscanf (buf, "(%d,%d)\n", x, y) != 2);
+	if (parse_tuple(buf, '(', ',', val, 2) != 2)
+		return 1;
+	*x = val[0];
+	*y = val[1];
+	return 0;
 }
 
 /*
- * read_position_from_ams() - read the (x,y,z) position from AMS via sysfs file
+ * read_position_xyz() - read and parse a (x,y,z) position from a sysfs file
+ * formatted either as "(x,y,z)" (open='(', sep=',') or "x y z" (open=0, sep=' ')
  */
-static int read_position_from_ams (int *x, int *y, int *z)
+static int read_position_xyz (const char* filename, char open, char sep,
+                              int *x, int *y, int *z)
 {
 	char buf[BUF_LEN];
-	int ret;
-	if ((ret = slurp_file(AMS_POSITION_FILE, buf)))
+	int ret, val[3];
+	if ((ret = read_position_file(filename, buf)))
 		return ret;
-	return (sscanf (buf, "%d %d %d\n", x, y, z) != 3);
+	if (parse_tuple(buf, open, sep, val, 3) != 3)
+		return 1;
+	*x = val[0];
+	*y = val[1];
+	*z = val[2];
+	return 0;
+}
+
+/*
+ * read_position_from_ams() - read the (x,y,z) position from AMS via sysfs file
+ */
+static int read_position_from_ams (int *x, int *y, int *z)
+{
+	return read_position_xyz(AMS_POSITION_FILE, 0, ' ', x, y, z);
 }
 
 /*
@@ -174,11 +291,7 @@ static int read_position_from_ams (int *x, int *y, int *z)
  */
 static int read_position_from_hp3d (int *x, int *y, int *z)
 {
-	char buf[BUF_LEN];
-	int ret;
-	if ((ret = slurp_file(HP3D_POSITION_FILE, buf)))
-		return ret;
-	return (sscanf (buf, "(%d,%d,%d)\n", x, y, z) != 3);
+	return read_position_xyz(HP3D_POSITION_FILE, '(', ',', x, y, z);
 }
 
 /*
@@ -187,11 +300,7 @@ static int read_position_from_hp3d (int *x, int *y, int *z)
  */
 static int read_position_from_applesmc (int *x, int *y, int *z)
 {
-	char buf[BUF_LEN];
-	int ret;
-	if ((ret = slurp_file(APPLESMC_POSITION_FILE, buf)))
-		return ret;
-	return (sscanf (buf, "(%d,%d,%d)\n", x, y, z) != 3);
+	return read_position_xyz(APPLESMC_POSITION_FILE, '(', ',', x, y, z);
 }
 
 /*
@@ -199,13 +308,26 @@ static int read_position_from_applesmc (int *x, int *y, int *z)
  * via sysfs file
  */
 static int read_position_from_toshiba_acpi (int *x, int *y, int *z)
+{
+	return read_position_xyz(TOSHIBA_POSITION_FILE, 0, ' ', x, y, z);
+}
+/*
+ * read_toshiba_movement() - read the movement flag of TOSHIBA_HAPS through
+ * the persistent descriptor, which also acknowledges a notification
+ */
+static int read_toshiba_movement (int *movement)
 {
 	char buf[BUF_LEN];
 	int ret;
-	if ((ret = slurp_file(TOSHIBA_POSITION_FILE, buf)))
+
+	ret = sysfs_attr_read(&toshiba_attr, buf, sizeof(buf));
+	if (ret < 0)
 		return ret;
-	return (sscanf (buf, "%d %d %d\n", x, y, z) != 3);
+	if (parse_tuple(buf, 0, 0, movement, 1) != 1)
+		return -EIO;
+	return 0;
 }
+
 /*
  * read_position_from_sysfs() - read the position either from HDAPS or
  * from AMS or from HP3D
@@ -242,24 +364,23 @@ static int read_int (const char* filename)
 }
 
 /*
- * write_int() - writes an integer to a file
+ * write_int() - write an integer to an open attribute, returns 0 or -errno
  */
-static int write_int (const char* filename, const int value)
+static int write_int (int fd, const int value)
 {
 	char buf[BUF_LEN];
-	int fd;
-	int size;
-	fd = open (filename, O_WRONLY);
-	if (fd < 0)
-	        return -1;
+	int size, ret;
+
 	size = snprintf (buf, BUF_LEN, "%i\n", value);
-	if (write (fd, buf, size) < 0)
-	        return -1;
-	return close (fd);
+	ret = pwrite (fd, buf, size, 0);
+	if (ret < 0)
+		return -errno;
+	return ret == size ? 0 : -EIO;
 }
 
 /*
- * get_km_activity() - returns 1 if there is keyboard or mouse activity
+ * get_km_activity() - returns 1 if there is keyboard or mouse activity,
+ * polled from the hdaps driver when there are no evdev devices to watch
  */
 static int get_km_activity ()
 {
@@ -272,89 +393,183 @@ static int get_km_activity ()
 	return 0;
 }
 
+/*
+ * km_index() - position of fd in km_fds, or -1
+ */
+static int km_index (int fd)
+{
+	int i;
+
+	for (i = 0; i < num_km_fds; i++)
+		if (km_fds[i] == fd)
+			return i;
+	return -1;
+}
+
+/*
+ * km_drain() - the built-in keyboard or mouse was used: consume its events
+ * and tell the detector when. A device which went away is closed.
+ */
+static void km_drain (int i, double unow)
+{
+	struct input_event ev[16];
+	ssize_t len;
+
+	while ((len = read(km_fds[i], ev, sizeof(ev))) > 0)
+		;
+	if (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR)) {
+		close(km_fds[i]); /* also drops it from the epoll set */
+		km_fds[i] = km_fds[--num_km_fds];
+		if (num_km_fds == 0)
+			detector.km_activity = get_km_activity;
+		return;
+	}
+	detector_km_activity(&detector, unow);
+}
+
+/*
+ * input_resync() - after the kernel dropped events (SYN_DROPPED), fetch the
+ * current axis values from the device instead of trusting the event stream.
+ */
+static void input_resync (int *x, int *y, int *z)
+{
+	struct input_absinfo abs;
+
+	if (ioctl(hdaps_input_fd, EVIOCGABS(ABS_X), &abs) == 0)
+		*x = abs.value;
+	if (ioctl(hdaps_input_fd, EVIOCGABS(ABS_Y), &abs) == 0)
+		*y = abs.value;
+	if (ioctl(hdaps_input_fd, EVIOCGABS(ABS_Z), &abs) == 0)
+		*z = abs.value;
+}
+
 /*
  * read_position_from_inputdev() - read the (x,y,z) position pair and time from hdaps
- * via the hdaps input device. Blocks there is a change in position.
+ * via the hdaps input device. The device is non-blocking, -EAGAIN is returned
+ * when there is no (complete) new position to read.
+ * Events are read in batches of up to INPUT_EVENT_BATCH, one position (frame,
+ * terminated by EV_SYN) is returned per call. A frame may span several reads.
  * The x and y arguments should contain the last read values, since if one of them
  * doesn't change it will not be assigned.
  */
 static int read_position_from_inputdev (int *x, int *y, int *z, double *utime)
 {
-	struct input_event ev;
-	int len, done = 0;
-	*utime = 0;
+	static struct input_event buf[INPUT_EVENT_BATCH];
+	static int buf_len = 0, buf_pos = 0;
+	static double frame_utime = 0; /* time of the current frame */
+	static int dropping = 0; /* discard events until the next SYN_REPORT */
+	struct input_event *ev;
+	int len;
+
 	while (1) {
-		len = read(hdaps_input_fd, &ev, sizeof(struct input_event));
-		if (len < 0) {
-			printlog(stderr, "ERROR: failed reading from input device: /dev/input/event%d  (%s).", hdaps_input_nr, strerror(errno));
-			return len;
+		if (buf_pos == buf_len) {
+			buf_pos = buf_len = 0;
+			len = read(hdaps_input_fd, buf, sizeof(buf));
+			if (len < 0 && errno == EAGAIN)
+				return -EAGAIN; /* nothing (more) to read right now */
+			if (len < 0)
+				len = -errno;
+			else if (len == 0 || len % sizeof(struct input_event))
+				len = -EIO; /* gone, or a short read */
+			if (len < 0) {
+				/* start over with whichever device comes next */
+				frame_utime = 0;
+				dropping = 0;
+				return len;
+			}
+			buf_len = len / sizeof(struct input_event);
+		}
+
+		ev = &buf[buf_pos++];
+		if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+			/* the kernel buffer overflowed, this frame is incomplete */
+			input_drops++;
+			dropping = 1;
+			if (verbose)
+				printf("input events dropped (%lu times)\n", input_drops);
+			continue;
 		}
-		if (len < (int)sizeof(struct input_event)) {
-			printlog(stderr, "ERROR: short read from input device: /dev/input/event%d (%d bytes).", hdaps_input_nr, len);
-			return -EIO;
+		if (dropping) {
+			if (ev->type != EV_SYN || ev->code != SYN_REPORT)
+				continue;
+			dropping = 0;
+			input_resync(x, y, z);
+			frame_utime = 0;
 		}
-		switch (ev.type) {
+
+		switch (ev->type) {
 			case EV_ABS: /* new X, Y or Z */
-				switch (ev.code) {
+				switch (ev->code) {
 					case ABS_X:
-						*x = ev.value;
+						*x = ev->value;
 						break;
 					case ABS_Y:
-						*y = ev.value;
+						*y = ev->value;
 						break;
 					case ABS_Z:
-						*z = ev.value;
+						*z = ev->value;
 						break;
 					default:
 						continue;
 				}
 				break;
 			case EV_SYN: /* X and Y now reflect latest measurement */
-				done = 1;
 				break;
 			default:
 				continue;
 		}
-		if (!*utime) /* first event's time is closest to reality */
-			*utime = ev.input_event_sec + ev.input_event_usec/1000000.0;
-		if (done)
+		if (!frame_utime) /* first event's time is closest to reality */
+			frame_utime = ev->input_event_sec + ev->input_event_usec/1000000.0;
+		if (ev->type == EV_SYN) {
+			*utime = frame_utime;
+			frame_utime = 0;
 			return 0;
+		}
 	}
 }
 
 
 /*
- * write_protect() - park/unpark
+ * write_protect() - park/unpark, through the disk's already open protect file
  */
-static int write_protect (const char *path, int val)
+static int write_protect (struct disk *d, int park)
 {
-	int fd, ret;
-	char buf[BUF_LEN];
+	const char *cmd = park ? d->park_cmd : "0";
 
 	if (dry_run)
 		return 0;
 
-	snprintf(buf, sizeof(buf), "%d", val);
-
-	fd = open (path, O_WRONLY);
-	if (fd < 0) {
-		printlog (stderr, "Could not open %s", path);
-		return fd;
+	if (pwrite (d->protect_fd, cmd, strlen(cmd), 0) < 0) {
+		printlog (stderr, "Could not write to %s.\nDoes your kernel/drive support IDLE_IMMEDIATE with UNLOAD?", d->protect_file);
+		return -1;
 	}
+	return 0;
+}
 
-	ret = write (fd, buf, strlen(buf));
-
-	if (ret < 0) {
-		printlog (stderr, "Could not write to %s.\nDoes your kernel/drive support IDLE_IMMEDIATE with UNLOAD?", path);
-		goto out;
-	}
-	ret = 0;
+/*
+ * read_protect() - read the remaining freeze time from the disk's protect file
+ */
+static int read_protect (struct disk *d)
+{
+	char buf[BUF_LEN];
+	int ret, val;
 
-out:
-	if (close (fd))
-		printlog (stderr, "Could not close %s", path);
+	ret = pread (d->protect_fd, buf, sizeof(buf)-1, 0);
+	if (ret < 0)
+		return -errno;
+	buf[ret] = 0;
+	if (parse_tuple(buf, 0, 0, &val, 1) != 1)
+		return -EIO;
+	return val;
+}
 
-	return ret;
+/*
+ * write_led() - switch the HP3D LED on or off
+ */
+static void write_led (int on)
+{
+	if (write_int (led_fd, on))
+		printlog (stderr, "Could not write to %s", HP3D_LED_FILE);
 }
 
 double get_utime (void)
@@ -369,23 +584,764 @@ double get_utime (void)
 }
 
 /*
- * SIGUSR1_handler - Handler for SIGUSR1, sleeps for a few seconds. Useful when suspending laptop.
+ * arm_timer() - arm a one-shot timerfd to expire after the given number of
+ *               seconds, 0 disarms it
+ */
+static void arm_timer (int fd, double seconds)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = seconds;
+	its.it_value.tv_nsec = (seconds - its.it_value.tv_sec) * 1000000000;
+	if (seconds > 0 && its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1; /* a zero value would disarm the timer */
+	if (timerfd_settime(fd, 0, &its, NULL))
+		printlog(stderr, "Could not arm timer: %s", strerror(errno));
+}
+
+/*
+ * read_timer() - acknowledge an expired timerfd,
+ *                returns the number of expirations
+ */
+static uint64_t read_timer (int fd)
+{
+	uint64_t expirations = 0;
+	if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+	return expirations;
+}
+
+/*
+ * sampling_arm() - arm the sample timer for the current absolute deadline
+ */
+static void sampling_arm (void)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value = sampling.deadline;
+	if (timerfd_settime(sample_timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+		printlog(stderr, "Could not arm sample timer: %s", strerror(errno));
+}
+
+/*
+ * sampling_start() - start the sampling clock at the given rate,
+ *                    the first sample is due one period from now
+ */
+static void sampling_start (int rate)
+{
+	clock_gettime(CLOCK_MONOTONIC, &sampling.deadline);
+	sampling.period_ns = 1000000000L / rate;
+	sampling.deadline.tv_nsec += sampling.period_ns;
+	while (sampling.deadline.tv_nsec >= 1000000000L) {
+		sampling.deadline.tv_nsec -= 1000000000L;
+		sampling.deadline.tv_sec++;
+	}
+	sampling_arm();
+}
+
+/*
+ * sampling_tick() - account for an expiry of the sample timer and arm it for
+ *                   the next deadline. Deadlines are exactly one period apart,
+ *                   so the time spent reading and analyzing a sample does not
+ *                   stretch the period. Deadlines that already passed are
+ *                   counted as overruns and skipped rather than caught up.
+ */
+static void sampling_tick (void)
+{
+	struct timespec now;
+	double late;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	late = (now.tv_sec - sampling.deadline.tv_sec) * 1000000.0 +
+	       (now.tv_nsec - sampling.deadline.tv_nsec) / 1000.0;
+	if (late < 0)
+		late = 0;
+	sampling.samples++;
+	sampling.jitter_sum += late;
+	sampling.jitter_sqr_sum += late*late;
+	if (late > sampling.jitter_max)
+		sampling.jitter_max = late;
+
+	do {
+		sampling.deadline.tv_nsec += sampling.period_ns;
+		while (sampling.deadline.tv_nsec >= 1000000000L) {
+			sampling.deadline.tv_nsec -= 1000000000L;
+			sampling.deadline.tv_sec++;
+		}
+		if (sampling.deadline.tv_sec > now.tv_sec ||
+		    (sampling.deadline.tv_sec == now.tv_sec &&
+		     sampling.deadline.tv_nsec > now.tv_nsec))
+			break;
+		sampling.overruns++;
+	} while (1);
+
+	sampling_arm();
+}
+
+/*
+ * sampling_report() - log the sampling statistics
+ */
+static void sampling_report (void)
+{
+	double avg, var;
+
+	if (!sampling.samples)
+		return;
+	avg = sampling.jitter_sum / sampling.samples;
+	var = sampling.jitter_sqr_sum / sampling.samples - avg*avg;
+	printlog(stdout, "Sampling: %lu samples at %ld Hz, %lu overruns, "
+	         "jitter avg %.0f us, stddev %.0f us, max %.0f us",
+	         sampling.samples, 1000000000L / sampling.period_ns,
+	         sampling.overruns, avg, var > 0 ? sqrt(var) : 0,
+	         sampling.jitter_max);
+}
+
+/*
+ * rate_set() - switch the sensor to a new sampling rate, at the driver and
+ *              for our own sample timer. If the driver refuses the rate,
+ *              stay where we are; rate_update() retries after
+ *              RATE_RETRY_SEC, and gives up on an idle rate refused
+ *              RATE_MAX_FAILURES times. A failed return to the full rate
+ *              still samples at the full rate ourselves.
  */
-void SIGUSR1_handler (int sig)
+static void rate_set (int new_rate, double unow)
 {
-	pause_now = 1;
+	int ret;
+
+	if (rate.file != NULL) {
+		ret = write_int(rate.fd, new_rate);
+		if (ret) {
+			if (!rate.failing)
+				printlog(stderr, "Could not set the sampling rate to %d Hz in %s: %s",
+				         new_rate, rate.file, strerror(-ret));
+			rate.failing = 1;
+			rate.failures++;
+			rate.retry_utime = unow + RATE_RETRY_SEC;
+			if (new_rate == rate.idle_rate &&
+			    ++rate.idle_failures >= RATE_MAX_FAILURES) {
+				printlog(stderr, "The driver keeps refusing %d Hz, staying at %d Hz",
+				         rate.idle_rate, rate.max_rate);
+				rate.idle_rate = rate.max_rate;
+			}
+			if (new_rate == rate.max_rate && poll_sysfs &&
+			    sampling_rate != rate.max_rate) {
+				sampling_rate = rate.max_rate;
+				sampling_start(rate.max_rate);
+			}
+			return;
+		}
+		rate.failing = 0;
+	}
+
+	if (rate.rate == rate.max_rate)
+		rate.time_max += unow - rate.since_utime;
+	else
+		rate.time_idle += unow - rate.since_utime;
+	rate.switches++;
+	rate.since_utime = unow;
+	rate.rate = new_rate;
+	if (sampling_rate != new_rate) {
+		sampling_rate = new_rate;
+		if (poll_sysfs)
+			sampling_start(new_rate);
+	}
 	if (verbose)
-		printlog(stdout, "SIGUSR1 called, pause_now is %d", pause_now);
+		printf("sampling_rate: %d\n", new_rate);
+}
+
+/*
+ * rate_update() - after each sample: go to the full rate as soon as the
+ *                 detector is near the threshold (or the disks are parked),
+ *                 back to the idle rate only after IDLE_RATE_SEC without.
+ */
+static void rate_update (double unow)
+{
+	if (rate.idle_rate == rate.max_rate)
+		return;
+	if (detector.near || parked) {
+		rate.active_utime = unow;
+		if (rate.rate != rate.max_rate && unow >= rate.retry_utime)
+			rate_set(rate.max_rate, unow);
+	} else if (rate.rate != rate.idle_rate && unow >= rate.retry_utime &&
+	           unow > rate.active_utime + IDLE_RATE_SEC) {
+		rate_set(rate.idle_rate, unow);
+	}
+}
+
+/*
+ * rate_probe() - find an idle rate the driver takes: the one asked for,
+ *                else the lis3lv02d rate below the full rate nearest to
+ *                it. Leaves the driver at the full rate. Returns the
+ *                rate, or 0 if the driver takes none.
+ */
+static int rate_probe (int wanted)
+{
+	int tried[NUM_LIS3_RATES] = { 0 };
+	int try = wanted, best, diff;
+	size_t i;
+
+	while (try) {
+		for (i = 0; i < NUM_LIS3_RATES; i++)
+			if (lis3_rates[i] == try)
+				tried[i] = 1;
+		if (write_int(rate.fd, try) == 0) {
+			if (write_int(rate.fd, rate.max_rate))
+				printlog(stderr, "Could not restore the sampling rate in %s", rate.file);
+			return try;
+		}
+		/* the nearest lis3lv02d rate not tried yet */
+		try = 0;
+		best = 0;
+		for (i = 0; i < NUM_LIS3_RATES; i++) {
+			diff = abs(lis3_rates[i] - wanted);
+			if (tried[i] || lis3_rates[i] >= rate.max_rate ||
+			    (try && diff >= best))
+				continue;
+			try = lis3_rates[i];
+			best = diff;
+		}
+	}
+	return 0;
+}
+
+/*
+ * rate_report() - restore the driver's rate and log the time spent at each
+ */
+static void rate_report (double unow)
+{
+	if (!rate.switches && !rate.failures)
+		return;
+	if (rate.rate != rate.max_rate)
+		rate_set(rate.max_rate, unow);
+	rate.time_max += unow - rate.since_utime;
+	printlog(stdout, "Sampling rate: %.0f s at %d Hz, %.0f s at %d Hz, %lu switches, "
+	         "%lu failed", rate.time_max, rate.max_rate, rate.time_idle,
+	         rate.idle_rate, rate.switches, rate.failures);
+}
+
+/*
+ * latency_add() - account a latency, given in seconds, in the histogram
+ */
+static void latency_add (struct latency_hist *h, double seconds)
+{
+	double us = seconds * 1000000;
+	int i = 0;
+
+	if (us < 0)
+		us = 0;
+	while (i < LATENCY_BUCKETS-1 && us >= (double)(1UL << i))
+		i++;
+	h->bucket[i]++;
+	h->count++;
+	h->sum += us;
+	if (us > h->max)
+		h->max = us;
+}
+
+/*
+ * latency_report() - log a histogram, one "<upper bound>:<count>" pair per
+ *                    non-empty bucket
+ */
+static void latency_report (struct latency_hist *h, const char *disk)
+{
+	char buf[LATENCY_BUCKETS*24];
+	int i, len = 0;
+
+	if (!h->count)
+		return;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		if (!h->bucket[i])
+			continue;
+		if (i < LATENCY_BUCKETS-1)
+			len += snprintf(buf+len, sizeof(buf)-len, " <%luus:%lu",
+			                1UL << i, h->bucket[i]);
+		else
+			len += snprintf(buf+len, sizeof(buf)-len, " more:%lu",
+			                h->bucket[i]);
+	}
+	printlog(stdout, "Latency %s%s%s: %lu times, avg %.0f us, max %.0f us,%s",
+	         h->name, disk ? " " : "", disk ? disk : "", h->count,
+	         h->sum / h->count, h->max, buf);
+}
+
+/*
+ * watch_fd() - add a file descriptor to the epoll set of the main loop
+ */
+static int watch_fd (int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.fd = fd;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*
+ * toshiba_start() - set the hardware protection level (if level > 0) and
+ *                   watch the movement attribute. The driver may signal a
+ *                   change with sysfs_notify(), which wakes up EPOLLPRI; we
+ *                   can't ask whether it does, so the attribute is polled
+ *                   at the sampling rate until the first notification.
+ */
+static int toshiba_start (int level)
+{
+	int ret;
+
+	if (level > 0) {
+		toshiba_level = read_int(TOSHIBA_LEVEL_FILE);
+		toshiba_level_fd = open(TOSHIBA_LEVEL_FILE, O_WRONLY);
+		if (toshiba_level_fd < 0)
+			ret = -errno;
+		else
+			ret = write_int(toshiba_level_fd, level);
+		if (ret) {
+			printlog(stderr, "Could not set the protection level in %s: %s",
+			         TOSHIBA_LEVEL_FILE, strerror(-ret));
+			toshiba_level = -1;
+		}
+	}
+
+	ret = sysfs_attr_open(&toshiba_attr, sysfs_reopen);
+	if (ret)
+		return ret;
+	/* a reopened attribute would leave the epoll set */
+	if (!sysfs_reopen && watch_fd(toshiba_attr.fd, EPOLLPRI) && verbose)
+		printlog(stdout, "Can not wait for movement notifications, polling %s",
+		         TOSHIBA_MOVEMENT_FILE);
+	sampling_start(sampling_rate);
+	return 0;
 }
 
 /*
- * SIGTERM_handler - Handler for SIGTERM, deletes the pidfile and exits.
+ * toshiba_notify() - a notification arrived, so the driver has them: from
+ *                    now on, polling is only a fallback while idle
  */
-void SIGTERM_handler (int sig)
+static void toshiba_notify (void)
 {
-	running = 0;
+	if (toshiba_notified)
+		return;
+	toshiba_notified = 1;
 	if (verbose)
-		printlog(stdout, "SIGTERM called, running is %d", running);
+		printlog(stdout, "Movement notifications from %s, polling only at %d Hz while idle",
+		         TOSHIBA_MOVEMENT_FILE, TOSHIBA_FALLBACK_RATE);
+}
+
+/*
+ * toshiba_poll() - pick the poll rate after a movement reading. While the
+ *                  machine moves or the disks are parked, the end of the
+ *                  movement may not be notified, so poll at the sampling
+ *                  rate; only when idle drop to TOSHIBA_FALLBACK_RATE.
+ */
+static void toshiba_poll (int movement)
+{
+	int rate = sampling_rate;
+
+	if (toshiba_notified && !movement && !parked)
+		rate = TOSHIBA_FALLBACK_RATE;
+	if (sampling.period_ns != 1000000000L / rate)
+		sampling_start(rate);
+}
+
+/*
+ * toshiba_stop() - restore the protection level found at startup
+ */
+static void toshiba_stop (void)
+{
+	sysfs_attr_close(&toshiba_attr);
+	if (toshiba_level >= 0)
+		write_int(toshiba_level_fd, toshiba_level);
+	if (toshiba_level_fd >= 0)
+		close(toshiba_level_fd);
+}
+
+/*
+ * park_worker_main() - wait for a job, write its value to our disk, repeat
+ */
+static void *park_worker_main (void *arg)
+{
+	struct park_worker *w = arg;
+	unsigned long seen;
+	int value;
+
+	pthread_mutex_lock(&park_lock);
+	seen = park_generation;
+	while (1) {
+		while (park_generation == seen && !park_quit)
+			pthread_cond_wait(&park_start, &park_lock);
+		if (park_quit)
+			break;
+		seen = park_generation;
+		value = park_value;
+		pthread_mutex_unlock(&park_lock);
+
+		write_protect(w->disk, value);
+		w->disk->done_utime = get_utime();
+
+		pthread_mutex_lock(&park_lock);
+		if (--park_pending == 0)
+			pthread_cond_signal(&park_done);
+	}
+	pthread_mutex_unlock(&park_lock);
+	return NULL;
+}
+
+/*
+ * park_pool_start() - spawn one park worker per disk. With a single disk
+ *                     the main loop writes itself and no thread is needed.
+ *                     The pool is restarted whenever the disk table changes.
+ */
+static int park_pool_start (void)
+{
+	pthread_attr_t attr;
+	int i;
+
+	park_quit = 0;
+	if (num_disks < 2)
+		return 0;
+
+	park_workers = calloc(num_disks, sizeof(struct park_worker));
+	if (park_workers == NULL) {
+		printlog(stderr, "Error allocating memory.");
+		return -1;
+	}
+
+	/* mlockall() locks every stack, keep them small */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PARK_WORKER_STACK);
+	for (i = 0; i < num_disks; i++) {
+		park_workers[i].disk = &disks[i];
+		if (pthread_create(&park_workers[i].thread, &attr,
+		                   park_worker_main, &park_workers[i])) {
+			printlog(stderr, "Could not start park worker for %s", disks[i].name);
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+		park_worker_count++;
+	}
+	pthread_attr_destroy(&attr);
+	return 0;
+}
+
+/*
+ * park_pool_stop() - stop and join all park workers
+ */
+static void park_pool_stop (void)
+{
+	int i;
+
+	pthread_mutex_lock(&park_lock);
+	park_quit = 1;
+	pthread_cond_broadcast(&park_start);
+	pthread_mutex_unlock(&park_lock);
+	for (i = 0; i < park_worker_count; i++)
+		pthread_join(park_workers[i].thread, NULL);
+	free(park_workers);
+	park_workers = NULL;
+	park_worker_count = 0;
+}
+
+/*
+ * protect_all() - park (1) or unpark (0) all disks at once and return when
+ *                 all writes are done. Returns the time in seconds between
+ *                 the first and the last disk finishing.
+ */
+static double protect_all (int value)
+{
+	double first, last;
+	int i;
+
+	if (park_worker_count == 0) {
+		/* a single disk, or no workers could be started */
+		for (i = 0; i < num_disks; i++) {
+			write_protect(&disks[i], value);
+			disks[i].done_utime = get_utime();
+		}
+		return 0;
+	}
+
+	pthread_mutex_lock(&park_lock);
+	park_value = value;
+	park_pending = park_worker_count;
+	park_generation++;
+	pthread_cond_broadcast(&park_start);
+	while (park_pending > 0)
+		pthread_cond_wait(&park_done, &park_lock);
+	pthread_mutex_unlock(&park_lock);
+
+	first = last = disks[0].done_utime;
+	for (i = 1; i < num_disks; i++) {
+		if (disks[i].done_utime < first)
+			first = disks[i].done_utime;
+		if (disks[i].done_utime > last)
+			last = disks[i].done_utime;
+	}
+	return last - first;
+}
+
+/*
+ * record() - append an event to the --record trace, if we are recording
+ */
+static void record (int type, int flags, int x, int y, int z, double unow)
+{
+	struct trace_record rec;
+
+	if (trace_file == NULL)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.usec = unow * 1000000;
+	rec.x = x;
+	rec.y = y;
+	rec.z = z;
+	rec.type = type;
+	rec.source = position_interface;
+	rec.flags = flags;
+	if (trace_write(trace_file, &rec)) {
+		printlog(stderr, "Could not write to the trace file, recording stopped.");
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+}
+
+/*
+ * freeze_disks() - (re)freeze all disks and (re)arm the unpark deadline
+ */
+static void freeze_disks (double unow, double udecided)
+{
+	double spread, last = 0;
+	int i;
+
+	spread = protect_all(1);
+	/*
+	 * Write protect before any output (xterm, or
+	 * whatever else is handling our stdout, may be
+	 * swapped out).
+	 */
+	if (!parked) {
+		stats.parks++;
+		stats.park_utime = unow;
+		/* how long did it take from the sensor to the heads? */
+		for (i = 0; i < num_disks; i++) {
+			latency_add(&disks[i].park_latency, disks[i].done_utime - udecided);
+			if (disks[i].done_utime > last)
+				last = disks[i].done_utime;
+		}
+		latency_add(&latency_actuate, last - udecided);
+		latency_add(&latency_total, last - unow);
+
+		if (park_worker_count)
+			printlog(stdout, "parking (%d disks within %.2f ms)",
+			         park_worker_count, spread * 1000);
+		else
+			printlog(stdout, "parking");
+		if (use_leds)
+			write_led (1);
+	}
+	parked = 1;
+	parked_utime = unow;
+	arm_timer(unpark_timer_fd, FREEZE_SECONDS);
+	record(TRACE_PARK, 0, 0, 0, 0, unow);
+}
+
+/*
+ * unfreeze_disks() - unpark all disks, called when the freeze expired
+ *                    or when pausing
+ */
+static void unfreeze_disks (void)
+{
+	int i;
+
+	for (i = 0; i < num_disks; i++) {
+		/* Sanity check */
+		if (!dry_run && !read_protect(&disks[i]))
+			printlog(stderr, "Error! Not parked when we "
+			       "thought we were... (paged out "
+			       "and timer expired?)");
+	}
+	protect_all(0); /* unprotect */
+	if (use_leds)
+		write_led (0);
+	parked = 0;
+	stats.parked_time += get_utime() - stats.park_utime;
+	arm_timer(unpark_timer_fd, 0);
+	printlog(stdout, "un-parking");
+	record(TRACE_UNPARK, 0, 0, 0, 0, get_utime());
+	if (trace_file != NULL)
+		fflush(trace_file); /* nothing is in a hurry now */
+}
+
+/*
+ * update_protection() - act upon the park decision for the sample taken at
+ *                       unow. Unparking is left to the unpark timer, which
+ *                       fires FREEZE_SECONDS after the last (re)freeze.
+ */
+static void update_protection (int park_now, double unow)
+{
+	double udecided = get_utime();
+
+	latency_add(&latency_decide, udecided - unow);
+	if (park_now && !paused &&
+	    (!parked || unow>parked_utime+REFREEZE_SECONDS)) {
+		/* Not frozen or freeze about to expire */
+		freeze_disks(unow, udecided);
+	}
+}
+
+/*
+ * fall_event() - /dev/freefall reported count events at unow. The fall goes
+ *                on until the device has been quiet for FALL_QUIET_SEC.
+ */
+static void fall_event (unsigned count, double unow)
+{
+	if (!fall.start_utime)
+		fall.start_utime = unow;
+	fall.last_utime = unow;
+	fall.events += count;
+	arm_timer(fall_timer_fd, FALL_QUIET_SEC);
+}
+
+/*
+ * fall_end() - the device went quiet, account how long the fall lasted: from
+ *              its first to its last event, as they were read
+ */
+static void fall_end (void)
+{
+	double duration = fall.last_utime - fall.start_utime;
+
+	if (!fall.start_utime)
+		return;
+	fall.count++;
+	fall.sum += duration;
+	if (duration > fall.max)
+		fall.max = duration;
+	if (verbose)
+		printlog(stdout, "fall over after %.0f ms (%lu events)",
+		         duration * 1000, fall.events);
+	fall.start_utime = 0;
+	fall.events = 0;
+}
+
+/*
+ * input_remember() - note the name and phys of the selected input device, to
+ *                    recognize it if it has to be searched for again
+ */
+static void input_remember (void)
+{
+	const struct input_device *d = device_lookup(hdaps_input_nr);
+
+	if (d == NULL)
+		return;
+	snprintf(input_rec.name, sizeof(input_rec.name), "%s", d->name);
+	snprintf(input_rec.phys, sizeof(input_rec.phys), "%s", d->phys);
+	input_rec.backoff = INPUT_RETRY_MIN_SEC;
+}
+
+/*
+ * input_lost() - reading the input device failed with err: close it and
+ *                search for it again, first after INPUT_RETRY_MIN_SEC and
+ *                backing off up to INPUT_RETRY_MAX_SEC. Until it is back
+ *                there is no protection.
+ */
+static void input_lost (int err, double unow)
+{
+	printlog(stderr, "ERROR: lost the input device /dev/input/event%d (%s), "
+	         "no protection until it is back", hdaps_input_nr, strerror(-err));
+	stats.read_errors++;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, hdaps_input_fd, NULL);
+	close(hdaps_input_fd);
+	hdaps_input_fd = -1;
+	detector_reset(&detector);
+	input_rec.lost_utime = unow;
+	input_rec.losses++;
+	input_rec.backoff = INPUT_RETRY_MIN_SEC;
+	arm_timer(input_retry_timer_fd, input_rec.backoff);
+}
+
+/*
+ * input_attach() - search for the lost input device, and watch it again if
+ *                  it is back. When searching on the retry timer (retry=1),
+ *                  a failure doubles the interval to the next search; the
+ *                  searches triggered by /dev/input changes don't back off.
+ */
+static int input_attach (int retry)
+{
+	double unow;
+	int nr, fd;
+
+	device_scan();
+	nr = device_find(input_rec.name, input_rec.phys);
+	fd = device_open(nr);
+	if (fd < 0) {
+		if (retry) {
+			input_rec.backoff *= 2;
+			if (input_rec.backoff > INPUT_RETRY_MAX_SEC)
+				input_rec.backoff = INPUT_RETRY_MAX_SEC;
+			arm_timer(input_retry_timer_fd, input_rec.backoff);
+		}
+		return -1;
+	}
+	fcntl(fd, F_SETFL, O_RDONLY|O_NONBLOCK);
+	if (watch_fd(fd, EPOLLIN)) {
+		printlog(stderr, "Could not watch the input device: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	hdaps_input_fd = fd;
+	hdaps_input_nr = nr;
+	arm_timer(input_retry_timer_fd, 0);
+	unow = get_utime();
+	input_rec.lost_time += unow - input_rec.lost_utime;
+	printlog(stdout, "Input device is back as /dev/input/event%d after %.1f s",
+	         nr, unow - input_rec.lost_utime);
+	input_rec.lost_utime = 0;
+	return 0;
+}
+
+/*
+ * input_watch_drain() - consume the /dev/input change notifications
+ */
+static void input_watch_drain (void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while (read(input_watch_fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * pause_protection() - unpark and ignore all park decisions for a while
+ */
+static void pause_protection (int seconds)
+{
+	if (parked)
+		unfreeze_disks();
+	paused = 1;
+	printlog(stdout, "pausing for %d seconds", seconds);
+	arm_timer(pause_timer_fd, seconds);
+	record(TRACE_PAUSE, 0, seconds, 0, 0, get_utime());
+	if (trace_file != NULL)
+		fflush(trace_file);
+}
+
+/*
+ * handle_signals() - read pending signals from the signalfd.
+ *                    SIGUSR1 pauses for a few seconds (useful when
+ *                    suspending the laptop), SIGTERM ends the main loop.
+ */
+static void handle_signals (void)
+{
+	struct signalfd_siginfo si;
+	while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+		if (si.ssi_signo == SIGUSR1) {
+			if (verbose)
+				printlog(stdout, "SIGUSR1 received");
+			pause_protection(SIGUSR1_SLEEP_SEC);
+		} else if (si.ssi_signo == SIGTERM) {
+			if (verbose)
+				printlog(stdout, "SIGTERM received");
+			running = 0;
+		}
+	}
 }
 
 /*
@@ -421,6 +1377,11 @@ void usage ()
 	printf("                                     sensitive.\n");
 	printf("   -a --adaptive                     Adaptive threshold (automatic increase\n");
 	printf("                                     when the built-in keyboard/mouse are used).\n");
+	printf("   -A --auto-threshold               Raise the threshold above the measured sensor\n");
+	printf("                                     noise (up to %gx, -s is the minimum).\n",
+	       NOISE_MAX_FACTOR);
+	printf("   -P --predict                      Park early when the movement is about to\n");
+	printf("                                     cross the threshold.\n");
 	printf("   -v --verbose                      Get verbose statistics.\n");
 	printf("   -b --background                   Run the process in the background.\n");
 	printf("   -p --pidfile[=<pidfile>]          Create a pid file when running\n");
@@ -435,8 +1396,17 @@ void usage ()
 	printf("                                     have no effect in this mode).\n");
 	printf("   -S --software-logic               Use the software fall detection logic even if the\n");
 	printf("                                     hardware one is available.\n");
+	printf("   -T --toshiba-level=<level>        Protection level of the TOSHIBA_HAPS\n");
+	printf("                                     hardware logic, 1 (low) to 3 (high).\n");
 	printf("   -L --no-leds                      Don't blink the LEDs.\n");
 	printf("   -l --syslog                       Log to syslog instead of stdout/stderr.\n");
+	printf("   -R --record=<file>                Append all samples and park decisions\n");
+	printf("                                     to a binary trace in <file>.\n");
+	printf("   -w --idle-rate=<rate>             Lower the sampling rate to <rate> Hz while\n");
+	printf("                                     the machine is stationary.\n");
+	printf("   -B --startup-profile              Log how long each step of the startup took.\n");
+	printf("   -C --control-socket=<path>        Accept commands on a unix socket at <path>,\n");
+	printf("                                     try: echo help | socat - UNIX:<path>\n");
 	printf("\n");
 	printf("   -V --version                      Display version information and exit.\n");
 	printf("   -h --help                         Display this message and exit.\n");
@@ -449,213 +1419,175 @@ void usage ()
 }
 
 /*
- * check_thresh() - compare a value to the threshold
- */
-void check_thresh (double val_sqr, double thresh, int* above, int* near,
-                   char* reason_out, char reason_mark)
-{
-	if (val_sqr > thresh*thresh*NEAR_THRESH_FACTOR*NEAR_THRESH_FACTOR) {
-		*near = 1;
-		*reason_out = tolower(reason_mark);
-	}
-	if (val_sqr > thresh*thresh) {
-		*above = 1;
-		*reason_out = toupper(reason_mark);
-	}
-}
-
-/*
- * analyze() - make a decision on whether to park given present readouts
- *             (remembers some past data in local static variables).
- * Computes and checks 3 values:
- *   velocity:     current position - prev position / time delta
- *   acceleration: current velocity - prev velocity / time delta
- *   average velocity: exponentially decaying average of velocity,
- *                     weighed by time delta.
- * The velocity and acceleration tests respond quickly to short sharp shocks,
- * while the average velocity test catches long, smooth movements (and
- * averages out measurement noise).
- * The adaptive threshold, if enabled, increases when (built-in) keyboard or
- * mouse activity happens shortly after some value was above or near the
- * adaptive threshold. The adaptive threshold slowly decreases back to the
- * base threshold when no value approaches it.
- */
-int analyze (int x, int y, double unow, double base_threshold,
-             int adaptive, int parked)
-{
-	static int x_last = 0, y_last = 0;
-	static double unow_last = 0, x_veloc_last = 0, y_veloc_last = 0;
-	static double x_avg_veloc = 0, y_avg_veloc = 0;
-	static int history = 0; /* how many recent valid samples? */
-	static double adaptive_threshold = -1; /* current adaptive thresh */
-	static int last_thresh_change = 0; /* last adaptive thresh change */
-	static int last_near_thresh = 0; /* last time we were near thresh */
-	static int last_km_activity; /* last time kbd/mouse activity seen */
-
-	double udelta, x_delta, y_delta, x_veloc, y_veloc, x_accel, y_accel;
-	double veloc_sqr, accel_sqr, avg_veloc_sqr;
-	double exp_weight;
-	double threshold; /* transient threshold for this iteration */
-	char reason[4]; /* "which threshold reached?" string for verbose */
-	int recently_near_thresh;
-	int above = 0, near = 0; /* above threshold, near threshold */
-
-	/* Adaptive threshold adjustment  */
-	if (adaptive_threshold<0) /* first invocation */
-		adaptive_threshold = base_threshold;
-	recently_near_thresh = unow < last_near_thresh + RECENT_PARK_SEC;
- 	if (adaptive && recently_near_thresh && get_km_activity())
-		last_km_activity = unow;
-	if (adaptive && unow > last_thresh_change + THRESH_ADAPT_SEC) {
-		if (recently_near_thresh) {
-			if (last_km_activity > last_near_thresh &&
-			    last_km_activity > last_thresh_change) {
-				/* Near threshold and k/m activity */
-				adaptive_threshold *= THRESH_INCREASE_FACTOR;
-				last_thresh_change = unow;
-			}
-		} else {
-			/* Recently never near threshold */
-			adaptive_threshold *= THRESH_DECREASE_FACTOR;
-			if (adaptive_threshold < base_threshold)
-				adaptive_threshold = base_threshold;
-			last_thresh_change = unow;
-		}
-	}
-
-	/* compute deltas */
-	udelta = unow - unow_last;
-	x_delta = x - x_last;
-	y_delta = y - y_last;
-
-	/* compute velocity */
-	x_veloc = x_delta/udelta;
-	y_veloc = y_delta/udelta;
-	veloc_sqr = x_veloc*x_veloc + y_veloc*y_veloc;
-
-	/* compute acceleration */
-	x_accel = (x_veloc - x_veloc_last)/udelta;
-	y_accel = (y_veloc - y_veloc_last)/udelta;
-	accel_sqr = x_accel*x_accel + y_accel*y_accel;
-
-	/* compute exponentially-decaying velocity average */
-	exp_weight = udelta/AVG_DEPTH_SEC; /* weight of this sample */
-	exp_weight = 1 - 1.0/(1+exp_weight); /* softly clamped to 1 */
-	x_avg_veloc = exp_weight*x_veloc + (1-exp_weight)*x_avg_veloc;
-	y_avg_veloc = exp_weight*y_veloc + (1-exp_weight)*y_avg_veloc;
-	avg_veloc_sqr = x_avg_veloc*x_avg_veloc + y_avg_veloc*y_avg_veloc;
-
-	threshold = adaptive_threshold;
-	if (parked) /* when parked, be reluctant to unpark */
-		threshold *= PARKED_THRESH_FACTOR;
-
-	/* Threshold test (uses Pythagoras's theorem) */
-	strncpy(reason, "   ", 4);
-
-	check_thresh(veloc_sqr, threshold*VELOC_ADJUST,
-	             &above, &near, reason+0, 'V');
-	check_thresh(accel_sqr, threshold*ACCEL_ADJUST,
-	             &above, &near, reason+1, 'A');
-	check_thresh(avg_veloc_sqr, threshold*AVG_VELOC_ADJUST,
-	             &above, &near, reason+2, 'X');
+ * add_disk (disk) - add the given disk to the disk table
+ */
+void add_disk (char* disk)
+{
+	struct disk *d;
 
-	if (verbose) {
-		printf("dt=%5.3f  "
-		       "dpos=(%3g,%3g)  "
-		       "vel=(%6.1f,%6.1f)*%g  "
-		       "acc=(%6.1f,%6.1f)*%g  "
-		       "avg_vel=(%6.1f,%6.1f)*%g  "
-		       "thr=%.1f  "
-		       "%s\n",
-		       udelta,
-		       x_delta, y_delta,
-		       x_veloc/VELOC_ADJUST,
-		       y_veloc/VELOC_ADJUST,
-		       VELOC_ADJUST*1.0,
-		       x_accel/ACCEL_ADJUST,
-		       y_accel/ACCEL_ADJUST,
-		       ACCEL_ADJUST*1.0,
-		       x_avg_veloc/AVG_VELOC_ADJUST,
-		       y_avg_veloc/AVG_VELOC_ADJUST,
-		       AVG_VELOC_ADJUST*1.0,
-		       threshold,
-		       reason);
+	if (num_disks == MAX_DISKS) {
+		printlog(stderr, "Too many disks, not protecting %s.", disk);
+		return;
 	}
-
-	if (udelta>1.0) { /* Too much time since last (resume from suspend?) */
-		history = 0;
-		x_avg_veloc = y_avg_veloc = 0;
+	d = &disks[num_disks++];
+	memset(d, 0, sizeof(*d));
+	d->protect_fd = -1;
+	snprintf(d->name, sizeof(d->name), "%s", disk);
+	d->park_latency.name = "decision to parked for";
+
+	d->method = kernel_interface;
+	if (d->method == UNLOAD_HEADS) {
+		snprintf(d->protect_file, sizeof(d->protect_file), UNLOAD_HEADS_FMT, disk);
+		d->protect_factor = 1000;
+	} else {
+		snprintf(d->protect_file, sizeof(d->protect_file), QUEUE_PROTECT_FMT, disk);
+		d->protect_factor = 1;
 	}
+	snprintf(d->park_cmd, sizeof(d->park_cmd), "%d",
+	         (FREEZE_SECONDS+FREEZE_EXTRA_SECONDS) * d->protect_factor);
+}
 
-	if (history<2) { /* Not enough data for meaningful result */
-		above = 0;
-		near = 0;
-		++history;
+/*
+ * close_disks () - close the protect files of all disks
+ */
+void close_disks (void)
+{
+	int i;
+	for (i = 0; i < num_disks; i++) {
+		if (disks[i].protect_fd >= 0)
+			close(disks[i].protect_fd);
+		disks[i].protect_fd = -1;
 	}
+}
 
-	if (near)
-		last_near_thresh = unow;
+extern char **environ;
 
-	x_last = x;
-	y_last = y;
-	x_veloc_last = x_veloc;
-	y_veloc_last = y_veloc;
-	unow_last = unow;
+/*
+ * modalias_match() - mark the modules driving the device with this modalias
+ */
+static void modalias_match (const char *alias, int *wanted)
+{
+	int i, j;
 
-	return above;
+	for (i = 0; i < NUM_MODULES; i++)
+		for (j = 0; j < MAX_MODALIASES && modules[i].modaliases[j]; j++)
+			if (fnmatch(modules[i].modaliases[j], alias, 0) == 0)
+				wanted[i] = 1;
 }
 
 /*
- * add_disk (disk) - add the given disk to the global disklist
+ * modalias_read() - read a modalias attribute, without the newline
  */
-void add_disk (char* disk)
+static int modalias_read (const char *path, char *buf, size_t len)
 {
-	char protect_file[FILENAME_MAX] = "";
-	if (kernel_interface == UNLOAD_HEADS)
-		snprintf(protect_file, sizeof(protect_file), UNLOAD_HEADS_FMT, disk);
-	else {
-		snprintf(protect_file, sizeof(protect_file), QUEUE_PROTECT_FMT, disk);
-	}
+	int fd, ret;
 
-	if (disklist == NULL) {
-		disklist = (struct list *)malloc(sizeof(struct list));
-		if (disklist == NULL) {
-			printlog(stderr, "Error allocating memory.");
-			exit(EXIT_FAILURE);
-		}
-		else {
-			strncpy(disklist->name, disk, sizeof(disklist->name));
-			strncpy(disklist->protect_file, protect_file, sizeof(disklist->protect_file));
-			disklist->next = NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = read(fd, buf, len-1);
+	close(fd);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+/*
+ * modalias_scan() - match the DMI modalias and those of the devices on the
+ *                   buses our drivers bind to against the module table
+ */
+static void modalias_scan (int *wanted)
+{
+	char path[FILENAME_MAX], alias[1024];
+	struct dirent *ep;
+	DIR *dp;
+	size_t i;
+
+	if (modalias_read(MODALIAS_DMI_FILE, alias, sizeof(alias)) == 0)
+		modalias_match(alias, wanted);
+	for (i = 0; i < sizeof(modalias_buses)/sizeof(modalias_buses[0]); i++) {
+		snprintf(path, sizeof(path), MODALIAS_BUS_FMT, modalias_buses[i]);
+		dp = opendir(path);
+		if (dp == NULL)
+			continue;
+		while ((ep = readdir(dp))) {
+			if (ep->d_name[0] == '.')
+				continue;
+			snprintf(path, sizeof(path), MODALIAS_BUS_FMT"/%s/modalias",
+			         modalias_buses[i], ep->d_name);
+			if (modalias_read(path, alias, sizeof(alias)) == 0)
+				modalias_match(alias, wanted);
 		}
+		closedir(dp);
 	}
-	else {
-		struct list *p = disklist;
-		while (p->next != NULL)
-			p = p->next;
-		p->next = (struct list *)malloc(sizeof(struct list));
-		if (p->next == NULL) {
-			printlog(stderr, "Error allocating memory.");
-			exit(EXIT_FAILURE);
-		}
-		else {
-			strncpy(p->next->name, disk, sizeof(p->next->name));
-			strncpy(p->next->protect_file, protect_file, sizeof(p->next->protect_file));
-			p->next->next = NULL;
+}
+
+/*
+ * load_modules() - load the modules for the hardware found in sysfs, all
+ *                  modprobes at once, and wait for them to finish. If no
+ *                  modalias matches (an alias missing from our table, or
+ *                  a bus without modaliases), try all of them. A module
+ *                  with a preferred alternative goes in a second round,
+ *                  and only if the first one left its sensor missing.
+ */
+static void load_modules (void)
+{
+	posix_spawn_file_actions_t actions;
+	pid_t pids[NUM_MODULES];
+	int wanted[NUM_MODULES] = { 0 };
+	char *argv[] = { "modprobe", "-q", NULL, NULL };
+	char names[128] = "";
+	int i, n = 0, round, status;
+	double start = get_utime();
+
+	modalias_scan(wanted);
+	for (i = 0; i < NUM_MODULES && !wanted[i]; i++)
+		;
+	if (i == NUM_MODULES) {
+		printlog(stdout, "No kernel module matches this hardware, trying all");
+		for (i = 0; i < NUM_MODULES; i++)
+			wanted[i] = 1;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+	for (round = 0; round < 2; round++) {
+		for (i = 0; i < NUM_MODULES; i++) {
+			pids[i] = 0;
+			if (!wanted[i] || (modules[i].prefer != NULL) != round)
+				continue;
+			if (round && access(modules[i].sensor, F_OK) == 0) {
+				if (verbose)
+					printlog(stderr, "Not loading %s, %s is there",
+					         modules[i].name, modules[i].sensor);
+				continue;
+			}
+			if (verbose)
+				printlog(stderr, "Loading %s", modules[i].name);
+			argv[2] = (char *) modules[i].name;
+			if (posix_spawnp(&pids[i], argv[0], &actions, NULL, argv, environ)) {
+				printlog(stderr, "Could not run modprobe %s", modules[i].name);
+				pids[i] = 0;
+				continue;
+			}
+			n++;
 		}
-	}
-}
 
-/*
- * free_disk (disk) - free the allocated memory
- */
-void free_disk (struct list *disk)
-{
-	if (disk != NULL) {
-		if (disk->next != NULL)
-			free_disk(disk->next);
-		free(disk);
+		for (i = 0; i < NUM_MODULES; i++) {
+			if (!pids[i])
+				continue;
+			if (waitpid(pids[i], &status, 0) > 0 && WIFEXITED(status) &&
+			    WEXITSTATUS(status) == 0)
+				snprintf(names + strlen(names), sizeof(names) - strlen(names),
+				         " %s", modules[i].name);
+		}
 	}
+	posix_spawn_file_actions_destroy(&actions);
+	printlog(stdout, "Loaded kernel modules:%s (%d tried) in %.0f ms",
+	         names[0] ? names : " none", n, (get_utime() - start) * 1000);
 }
 
 /*
@@ -665,21 +1597,15 @@ int select_interface (int modprobe)
 {
 	int fd;
 
-	char *modules[] = {"hdaps_ec", "hdaps", "ams", "hp_accel", "applesmc", "smo8800", "toshiba_haps", "toshiba_acpi", "acer_wmi"};
-	int mod_index;
 	int input_index;
-	char command[64];
 	position_interface = INTERFACE_NONE;
 
 	if (modprobe) {
 		if (verbose)
 			printlog(stderr, "Trying to load the correct kernel module");
-		for (mod_index = 0; mod_index < sizeof(modules)/sizeof(modules[0]); mod_index++) {
-			if (verbose)
-				printlog(stderr, "Loading %s", modules[mod_index]);
-			snprintf(command, sizeof(command), "modprobe %s 1>/dev/null 2>/dev/null", modules[mod_index]);
-			system(command);
-		}
+		load_modules();
+		/* the modules may have added input devices */
+		device_scan();
 	}
 
 	/* We don't know yet which interface to use, try HDAPS */
@@ -774,6 +1700,29 @@ int select_interface (int modprobe)
 	return position_interface;
 }
 
+/*
+ * disk_check() - whether autodetection protects the disk: it must support
+ *                parking, not be removable and be rotational (unless -r).
+ *                Returns 1 if so, 0 if it is not rotational, -1 otherwise.
+ */
+static int disk_check (const char *name)
+{
+	char path[FILENAME_MAX];
+	char removable[FILENAME_MAX];
+	char rotational[FILENAME_MAX];
+	snprintf(removable, sizeof(removable), REMOVABLE_FMT, name);
+	snprintf(rotational, sizeof(rotational), ROTATIONAL_FMT, name);
+
+	if (kernel_interface == UNLOAD_HEADS)
+		snprintf(path, sizeof(path), UNLOAD_HEADS_FMT, name);
+	else
+		snprintf(path, sizeof(path), QUEUE_PROTECT_FMT, name);
+
+	if (access(path, F_OK) || read_int(removable) != 0 || read_int(path) < 0)
+		return -1;
+	return read_int(rotational) == 1 || forcerotational;
+}
+
 /*
  * autodetect_devices()
  */
@@ -785,33 +1734,413 @@ int autodetect_devices ()
 	dp = opendir(SYSFS_BLOCK);
 	if (dp != NULL) {
 		while ((ep = readdir(dp))) {
-			char path[FILENAME_MAX];
-			char removable[FILENAME_MAX];
-			char rotational[FILENAME_MAX];
-			snprintf(removable, sizeof(removable), REMOVABLE_FMT, ep->d_name);
-			snprintf(rotational, sizeof(rotational), ROTATIONAL_FMT, ep->d_name);
-
-			if (kernel_interface == UNLOAD_HEADS)
-				snprintf(path, sizeof(path), UNLOAD_HEADS_FMT, ep->d_name);
-			else
-				snprintf(path, sizeof(path), QUEUE_PROTECT_FMT, ep->d_name);
-
-			if (access(path, F_OK) == 0 && read_int(removable) == 0 && read_int(path) >= 0) {
-				if (read_int(rotational) == 1 || forcerotational) {
+			switch (disk_check(ep->d_name)) {
+				case 1:
 					printlog(stdout, "Adding autodetected device: %s", ep->d_name);
 					add_disk(ep->d_name);
 					num_devices++;
-				}
-				else {
+					break;
+				case 0:
 					printlog(stdout, "Not adding autodetected device \"%s\", it seems not to be a rotational drive.", ep->d_name);
-				}
+					break;
 			}
 		}
 		(void)closedir(dp);
 	}
+	disks_autodetected = 1;
 	return num_devices;
 }
 
+/*
+ * disk_index() - the disk table entry of the named disk, or -1
+ */
+static int disk_index (const char *name)
+{
+	int i;
+
+	for (i = 0; i < num_disks; i++)
+		if (strcmp(disks[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * disk_wanted() - whether a disk that appeared while running is to be
+ *                 protected: with autodetection if it passes its checks,
+ *                 otherwise if it was one of the configured disks
+ */
+static int disk_wanted (const char *name)
+{
+	int i;
+
+	if (disks_autodetected)
+		return disk_check(name) > 0;
+	for (i = 0; i < num_wanted_disks; i++)
+		if (strcmp(wanted_disks[i], name) == 0)
+			return 1;
+	return 0;
+}
+
+/*
+ * hotplug_add() - start protecting a disk that was plugged in
+ */
+static void hotplug_add (const char *name)
+{
+	struct disk *d;
+
+	if (disk_index(name) >= 0 || !disk_wanted(name))
+		return;
+	if (num_disks == MAX_DISKS) {
+		printlog(stderr, "Too many disks, not protecting %s.", name);
+		return;
+	}
+
+	park_pool_stop();
+	add_disk((char *) name);
+	d = &disks[num_disks-1];
+	if (!dry_run) {
+		d->protect_fd = open(d->protect_file, O_RDWR);
+		if (d->protect_fd < 0) {
+			printlog(stderr, "Could not open %s, not protecting %s.",
+			         d->protect_file, name);
+			num_disks--;
+			d = NULL;
+		}
+	}
+	if (d != NULL) {
+		printlog(stdout, "Adding hotplugged device: %s", name);
+		if (parked)
+			write_protect(d, 1); /* join the others until they unpark */
+	}
+	if (park_pool_start())
+		park_pool_stop(); /* protect_all() writes one disk after the other */
+}
+
+/*
+ * hotplug_remove() - stop protecting a disk that went away
+ */
+static void hotplug_remove (const char *name)
+{
+	int i = disk_index(name);
+
+	if (i < 0)
+		return;
+
+	park_pool_stop();
+	if (disks[i].protect_fd >= 0)
+		close(disks[i].protect_fd);
+	memmove(&disks[i], &disks[i+1], (num_disks-i-1) * sizeof(disks[0]));
+	num_disks--;
+	printlog(stdout, "Removed device: %s", name);
+	if (num_disks == 0)
+		printlog(stderr, "WARNING: No devices left to protect.");
+	if (park_pool_start())
+		park_pool_stop();
+}
+
+/*
+ * hotplug_drain() - read the pending uevents, add and remove whole disks
+ */
+static void hotplug_drain (void)
+{
+	struct uevent ev;
+	int ret;
+
+	while ((ret = uevent_read(uevent_fd, &ev)) == 0) {
+		if (ev.action == NULL || ev.subsystem == NULL || ev.devtype == NULL ||
+		    ev.devname == NULL || strcmp(ev.subsystem, "block") ||
+		    strcmp(ev.devtype, "disk"))
+			continue;
+		if (strcmp(ev.action, "add") == 0)
+			hotplug_add(ev.devname);
+		else if (strcmp(ev.action, "remove") == 0)
+			hotplug_remove(ev.devname);
+	}
+	/* ENOBUFS: the kernel dropped events, we may miss a disk */
+	if (ret != -EAGAIN)
+		printlog(stderr, "Could not read disk hotplug events: %s", strerror(-ret));
+}
+
+/*
+ * startup_mark() - note that a step of the startup is done
+ */
+static void startup_mark (const char *name)
+{
+	if (num_startup_phases == MAX_STARTUP_PHASES)
+		return;
+	startup[num_startup_phases].name = name;
+	startup[num_startup_phases].utime = get_utime();
+	num_startup_phases++;
+}
+
+/*
+ * startup_report() - log how long each step of the startup took, and when
+ *                    protection was armed (the last step)
+ */
+static void startup_report (void)
+{
+	struct timespec boot;
+	double start = startup[0].utime, prev = start, armed;
+	int i;
+
+	for (i = 1; i < num_startup_phases; i++) {
+		printlog(stdout, "Startup %-20s %8.1f ms  (+%.1f ms)", startup[i].name,
+		         (startup[i].utime - start) * 1000,
+		         (startup[i].utime - prev) * 1000);
+		prev = startup[i].utime;
+	}
+	armed = prev;
+	if (clock_gettime(CLOCK_BOOTTIME, &boot) == 0)
+		printlog(stdout, "Startup took %.1f ms, protection armed %.3f s after boot",
+		         (armed - start) * 1000,
+		         boot.tv_sec + boot.tv_nsec/1e9 - (get_utime() - armed));
+}
+
+/*
+ * startup_wait() - sleep until the attribute at path may have appeared: the
+ *                  kernel announced a device (uevent), or something changed
+ *                  in its directory (inotify; sysfs doesn't report new
+ *                  attributes, but the uevent follows them), or
+ *                  STARTUP_RECHECK_SEC passed, as often as the old polling
+ *                  looked. Returns -ETIMEDOUT after the deadline.
+ */
+static int startup_wait (const char *path, double deadline)
+{
+	char dir[FILENAME_MAX], *slash;
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct uevent ev;
+	struct pollfd pfd[2];
+	double left = deadline - get_utime();
+	int i, n = 0;
+
+	if (left <= 0)
+		return -ETIMEDOUT;
+	if (left > STARTUP_RECHECK_SEC)
+		left = STARTUP_RECHECK_SEC;
+
+	if (startup_fds[0] < 0)
+		startup_fds[0] = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+	if (startup_fds[1] < 0)
+		startup_fds[1] = uevent_open();
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+	if (slash != NULL)
+		*slash = 0;
+	/* the directory may not be there yet either, then we rely on uevents */
+	if (startup_fds[0] >= 0)
+		inotify_add_watch(startup_fds[0], dir, IN_CREATE|IN_ATTRIB|IN_MOVED_TO);
+
+	for (i = 0; i < 2; i++)
+		if (startup_fds[i] >= 0) {
+			pfd[n].fd = startup_fds[i];
+			pfd[n].events = POLLIN;
+			n++;
+		}
+	poll(pfd, n, left * 1000 + 1);
+
+	if (startup_fds[0] >= 0)
+		while (read(startup_fds[0], buf, sizeof(buf)) > 0)
+			;
+	if (startup_fds[1] >= 0)
+		while (uevent_read(startup_fds[1], &ev) == 0)
+			;
+	return 0;
+}
+
+/*
+ * startup_wait_end() - close what startup_wait() needed
+ */
+static void startup_wait_end (void)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (startup_fds[i] >= 0)
+			close(startup_fds[i]);
+		startup_fds[i] = -1;
+	}
+}
+
+/*
+ * parse_bool() - "1", "on", "true" or "yes", and their opposites, or -1
+ */
+static int parse_bool (const char *s)
+{
+	if (!strcmp(s, "1") || !strcmp(s, "on") || !strcmp(s, "true") || !strcmp(s, "yes"))
+		return 1;
+	if (!strcmp(s, "0") || !strcmp(s, "off") || !strcmp(s, "false") || !strcmp(s, "no"))
+		return 0;
+	return -1;
+}
+
+/*
+ * set_adaptive() - switch the adaptive threshold on or off. Without -a
+ *                  at startup, the keyboard and mouse are looked for now.
+ */
+static void set_adaptive (int on)
+{
+	int i;
+
+	detector.adaptive = on;
+	if (!on || num_km_fds > 0)
+		return;
+	num_km_fds = device_find_km(km_fds, MAX_KM_DEVICES,
+	                            hardware_logic || poll_sysfs ? -1 : hdaps_input_nr);
+	for (i = 0; i < num_km_fds; i++)
+		if (watch_fd(km_fds[i], EPOLLIN)) {
+			printlog(stderr, "Could not watch the keyboard/mouse: %s", strerror(errno));
+			for (i = 0; i < num_km_fds; i++)
+				close(km_fds[i]);
+			num_km_fds = 0;
+		}
+	if (num_km_fds > 0)
+		detector.km_activity = NULL;
+}
+
+/*
+ * set_dry_run() - stop or start actually parking. The protect attributes
+ *                 are only open if we ever parked for real.
+ */
+static int set_dry_run (int on)
+{
+	struct disk *p;
+	int i;
+
+	if (on && parked)
+		unfreeze_disks();
+	for (i = 0; i < num_disks && !on; i++) {
+		p = &disks[i];
+		if (p->protect_fd < 0)
+			p->protect_fd = open(p->protect_file, O_RDWR);
+		if (p->protect_fd < 0)
+			return -errno;
+	}
+	dry_run = on;
+	return 0;
+}
+
+/*
+ * control_stats() - the "stats" command: counters since the start
+ */
+static void control_stats (struct control_client *c)
+{
+	double unow = get_utime();
+
+	control_reply(c, "uptime %.1f", unow - stats.start_utime);
+	control_reply(c, "samples %lu", stats.samples);
+	control_reply(c, "read_errors %lu", stats.read_errors);
+	control_reply(c, "input_drops %lu", input_drops);
+	control_reply(c, "parks %lu", stats.parks);
+	control_reply(c, "parked_time %.1f", stats.parked_time +
+	              (parked ? unow - stats.park_utime : 0));
+	control_reply(c, "parked %d", parked);
+	control_reply(c, "paused %d", paused);
+	control_reply(c, "disks %d", num_disks);
+}
+
+/*
+ * control_threshold() - the "threshold" command: the current threshold
+ *                       and what it is made of
+ */
+static void control_threshold (struct control_client *c)
+{
+	control_reply(c, "threshold %.1f", detector.adaptive_threshold);
+	control_reply(c, "sensitivity %g", detector.base_threshold);
+	control_reply(c, "adaptive %d", detector.adaptive);
+	control_reply(c, "auto_threshold %d", detector.auto_threshold);
+	if (detector.auto_threshold)
+		control_reply(c, "noise_threshold %.1f", detector.noise_threshold);
+	control_reply(c, "dry_run %d", dry_run);
+}
+
+/*
+ * control_set() - the "set <name> <value>" command. Returns an error
+ *                 message or NULL.
+ */
+static const char *control_set (const char *name, const char *value)
+{
+	char *end;
+	double val;
+	int on = parse_bool(value);
+
+	if (!strcmp(name, "sensitivity")) {
+		val = strtod(value, &end);
+		if (*end || val <= 0)
+			return "sensitivity must be a positive number";
+		if (hardware_logic)
+			return "the hardware logic has no sensitivity";
+		detector.base_threshold = val;
+		detector.adaptive_threshold = val; /* adapts again from here */
+		printlog(stdout, "control: sensitivity %g", val);
+	} else if (!strcmp(name, "adaptive")) {
+		if (on < 0)
+			return "adaptive must be on or off";
+		if (hardware_logic)
+			return "the hardware logic has no threshold";
+		set_adaptive(on);
+		printlog(stdout, "control: adaptive %s", on ? "on" : "off");
+	} else if (!strcmp(name, "dry-run")) {
+		if (on < 0)
+			return "dry-run must be on or off";
+		if (set_dry_run(on))
+			return "could not open the protect attributes";
+		printlog(stdout, "control: dry run %s", on ? "on" : "off");
+	} else {
+		return "unknown setting";
+	}
+	return NULL;
+}
+
+/*
+ * control_command() - run a line from the control socket, the reply ends
+ *                     with "ok" or "error <reason>"
+ */
+static void control_command (struct control_client *c, char *line)
+{
+	const char *err = NULL;
+	char *argv[4], *save = NULL, *end;
+	int argc = 0;
+	long seconds;
+
+	argv[0] = strtok_r(line, " \t", &save);
+	while (argv[argc] != NULL && ++argc < 4)
+		argv[argc] = strtok_r(NULL, " \t", &save);
+	if (argc == 0)
+		return;
+
+	if (!strcmp(argv[0], "stats") && argc == 1) {
+		control_stats(c);
+	} else if (!strcmp(argv[0], "threshold") && argc == 1) {
+		control_threshold(c);
+	} else if (!strcmp(argv[0], "set") && argc == 3) {
+		err = control_set(argv[1], argv[2]);
+	} else if (!strcmp(argv[0], "pause") && argc == 2) {
+		seconds = strtol(argv[1], &end, 10);
+		if (*end || seconds <= 0 || seconds > INT_MAX)
+			err = "pause needs a number of seconds";
+		else
+			pause_protection(seconds);
+	} else if (!strcmp(argv[0], "resume") && argc == 1) {
+		if (paused) {
+			arm_timer(pause_timer_fd, 0);
+			paused = 0;
+			printlog(stdout, "control: resumed");
+		}
+	} else if (!strcmp(argv[0], "quit") && argc == 1) {
+		control_close(c);
+		return;
+	} else if (!strcmp(argv[0], "help") && argc == 1) {
+		control_reply(c, "stats | threshold | pause <seconds> | resume | quit");
+		control_reply(c, "set sensitivity <n> | set adaptive <on|off> | set dry-run <on|off>");
+	} else {
+		err = "unknown command, try help";
+	}
+	if (err)
+		control_reply(c, "error %s", err);
+	else
+		control_reply(c, "ok");
+}
+
 /*
  * main() - loop forever, reading the hdaps values and
  *          parking/unparking as necessary
@@ -819,12 +2148,17 @@ int autodetect_devices ()
 int main (int argc, char** argv)
 {
 	struct utsname sysinfo;
-	struct list *p = NULL;
-	int c, park_now, protect_factor;
+	struct disk *p;
+	int c, park_now, kver[2];
+	const char *record_file = NULL, *control_socket = NULL;
+	struct trace_header trace_hdr;
 	int x = 0, y = 0, z = 0;
-	int fd, i, ret, threshold = 15, adaptive = 0,
-	pidfile = 0, parked = 0, forceadd = 0;
-	double unow = 0, parked_utime = 0;
+	int fd, i, k, n, ret = 0, threshold = 15, adaptive = 0, auto_threshold = 0,
+	pidfile = 0, forceadd = 0, idle_rate = 0, predict = 0, hw_level = 0;
+	int status = 0; /* exit status: a signal ends the run cleanly */
+	double unow = 0, deadline;
+	sigset_t sigmask;
+	struct epoll_event events[8];
 #ifdef HAVE_LIBCONFIG
 	config_t cfg;
 	config_setting_t *setting;
@@ -854,24 +2188,34 @@ int main (int argc, char** argv)
 		{"syslog", no_argument, NULL, 'l'},
 		{"force", no_argument, NULL, 'f'},
 		{"force-rotational", no_argument, NULL, 'r'},
+		{"record", required_argument, NULL, 'R'},
+		{"auto-threshold", no_argument, NULL, 'A'},
+		{"idle-rate", required_argument, NULL, 'w'},
+		{"predict", no_argument, NULL, 'P'},
+		{"toshiba-level", required_argument, NULL, 'T'},
+		{"startup-profile", no_argument, NULL, 'B'},
+		{"control-socket", required_argument, NULL, 'C'},
 		{NULL, 0, NULL, 0}
 	};
 
-	if (uname(&sysinfo) < 0 || strcmp("2.6.27", sysinfo.release) <= 0) {
-		protect_factor = 1000;
+	startup_mark ("start");
+
+	if (uname(&sysinfo) < 0 || strcmp("2.6.27", sysinfo.release) <= 0)
 		kernel_interface = UNLOAD_HEADS;
-	}
-	else {
-		protect_factor = 1;
+	else
 		kernel_interface = PROTECT;
-	}
+
+	/* sysfs attributes can only be reread at offset 0 since kernfs (3.14) */
+	if (parse_tuple(sysinfo.release, 0, '.', kver, 2) != 2 ||
+	    kver[0] < 3 || (kver[0] == 3 && kver[1] < 14))
+		sysfs_reopen = 1;
 
 	openlog(PACKAGE_NAME, LOG_PID, LOG_DAEMON);
 
 #ifdef HAVE_LIBCONFIG
-	while ((c = getopt_long(argc, argv, "d:s:vbac:p::tyHSVhLlfr", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "d:s:vbaAc:p::tyHSVhLlfrR:w:PT:BC:", longopts, NULL)) != -1) {
 #else
-	while ((c = getopt_long(argc, argv, "d:s:vbap::tyHSVhLlfr", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "d:s:vbaAp::tyHSVhLlfrR:w:PT:BC:", longopts, NULL)) != -1) {
 #endif
 		switch (c) {
 			case 'd':
@@ -886,6 +2230,9 @@ int main (int argc, char** argv)
 			case 'a':
 				adaptive = 1;
 				break;
+			case 'A':
+				auto_threshold = 1;
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -931,6 +2278,24 @@ int main (int argc, char** argv)
 			case 'r':
 				forcerotational = 1;
 				break;
+			case 'R':
+				record_file = optarg;
+				break;
+			case 'w':
+				idle_rate = atoi(optarg);
+				break;
+			case 'P':
+				predict = 1;
+				break;
+			case 'T':
+				hw_level = atoi(optarg);
+				break;
+			case 'B':
+				startup_profile = 1;
+				break;
+			case 'C':
+				control_socket = optarg;
+				break;
 			case 'h':
 			default:
 				usage();
@@ -939,6 +2304,7 @@ int main (int argc, char** argv)
 	}
 
 	printlog(stdout, "Starting "PACKAGE_NAME);
+	startup_mark ("options");
 
 #ifdef HAVE_LIBCONFIG
 	config_init(&cfg);
@@ -946,11 +2312,10 @@ int main (int argc, char** argv)
 		if (!config_read_file(&cfg, cfg_file)) {
 			printlog(stderr, "%s:%d - %s", config_error_file(&cfg), config_error_line(&cfg), config_error_text(&cfg));
 			config_destroy(&cfg);
-			free_disk(disklist);
 			return 1;
 		}
 
-		if (disklist == NULL) {
+		if (num_disks == 0) {
 			setting = config_lookup(&cfg, "device");
 			if (setting != NULL) {
 				if (config_setting_is_array(setting)) {
@@ -971,6 +2336,22 @@ int main (int argc, char** argv)
 			config_lookup_bool(&cfg, "adaptive", &adaptive);
 		}
 
+		if (auto_threshold == 0) {
+			config_lookup_bool(&cfg, "auto_threshold", &auto_threshold);
+		}
+
+		if (idle_rate == 0) {
+			config_lookup_int(&cfg, "idle_rate", &idle_rate);
+		}
+
+		if (predict == 0) {
+			config_lookup_bool(&cfg, "predict", &predict);
+		}
+
+		if (hw_level == 0) {
+			config_lookup_int(&cfg, "toshiba_level", &hw_level);
+		}
+
 		if (background == 0) {
 			config_lookup_bool(&cfg, "background", &background);
 		}
@@ -985,25 +2366,33 @@ int main (int argc, char** argv)
 		if (dosyslog == 0) {
 			config_lookup_bool(&cfg, "syslog", &dosyslog);
 		}
+
+		if (startup_profile == 0) {
+			config_lookup_bool(&cfg, "startup_profile", &startup_profile);
+		}
+
+		if (control_socket == NULL) {
+			config_lookup_string(&cfg, "control_socket", &control_socket);
+		}
 	} else if (cfgfile) {
 		printlog(stderr, "Could not open configuration file %s.", cfg_file);
 		config_destroy(&cfg);
-		free_disk(disklist);
 		return 1;
 	}
+	startup_mark ("configuration");
 #endif
 
-	if (disklist && forceadd) {
+	if (num_disks && forceadd) {
 		char protect_method[FILENAME_MAX] = "";
-		p = disklist;
-		while (p != NULL) {
+		for (i = 0; i < num_disks; i++) {
+			p = &disks[i];
 			snprintf(protect_method, sizeof(protect_method), QUEUE_METHOD_FMT, p->name);
-			if (kernel_interface == UNLOAD_HEADS)
+			if (p->method == UNLOAD_HEADS)
 				fd = open (p->protect_file, O_RDWR);
 			else
 				fd = open (protect_method, O_RDWR);
 			if (fd > 0) {
-				if (kernel_interface == UNLOAD_HEADS)
+				if (p->method == UNLOAD_HEADS)
 					ret = write(fd, FORCE_UNLOAD_HEADS, strlen(FORCE_UNLOAD_HEADS));
 				else
 					ret = write(fd, FORCE_PROTECT_METHOD, strlen(FORCE_PROTECT_METHOD));
@@ -1015,25 +2404,31 @@ int main (int argc, char** argv)
 			}
 			else
 				printlog(stderr, "Could not open %s for forcely enabling UNLOAD feature", p->protect_file);
-
-			p = p->next;
 		}
 	}
 
-	if (disklist == NULL) {
+	for (i = 0; i < num_disks; i++)
+		memcpy(wanted_disks[i], disks[i].name, sizeof(wanted_disks[i]));
+	num_wanted_disks = num_disks;
+
+	if (num_disks == 0) {
 		printlog(stdout, "WARNING: You did not supply any devices to protect, trying autodetection.");
 		if (autodetect_devices() < 1)
 			printlog(stderr, "Could not detect any devices.");
 	}
 
-	if (disklist == NULL)
+	if (num_disks == 0)
 		usage();
+	startup_mark ("disks");
 
 	/* Let's see if we're on a ThinkPad or on an *Book */
 	if (!position_interface)
 		select_interface(0);
-	if (!position_interface)
+	startup_mark ("interface");
+	if (!position_interface) {
 		select_interface(1);
+		startup_mark ("interface (modules)");
+	}
 
 	if (!position_interface && !hardware_logic) {
 		printlog(stdout, "Could not find a suitable interface");
@@ -1118,16 +2513,31 @@ int main (int argc, char** argv)
 			}
 		}
 	}
+	startup_mark ("sensor device");
 	if (position_interface != INTERFACE_HP3D && position_interface != INTERFACE_FREEFALL) {
 		/* LEDs are not supported yet on other systems */
 		use_leds = 0;
 	}
 	if (use_leds) {
-		fd = open(HP3D_LED_FILE, O_WRONLY);
-		if (fd < 0)
+		led_fd = open(HP3D_LED_FILE, O_WRONLY);
+		if (led_fd < 0)
 			use_leds = 0;
-		else
-			close(fd);
+	}
+
+	if (control_socket) {
+		/* resolve before daemon() changes the working directory */
+		if (control_socket[0] != '/' && getcwd(control_path, sizeof(control_path)))
+			strncat(control_path, "/", sizeof(control_path) - strlen(control_path) - 1);
+		strncat(control_path, control_socket, sizeof(control_path) - strlen(control_path) - 1);
+	}
+
+	if (record_file) {
+		/* open before daemon() changes the working directory */
+		trace_file = fopen (record_file, "a+b");
+		if (trace_file == NULL) {
+			printlog (stderr, "Could not open trace file %s: %s", record_file, strerror(errno));
+			return 1;
+		}
 	}
 
 	if (background) {
@@ -1158,55 +2568,84 @@ int main (int argc, char** argv)
 		}
 	}
 
+	if (background)
+		startup_mark ("daemon");
+
 	mlockall(MCL_FUTURE);
 
+	detector_init(&detector, threshold, adaptive);
+	detector.verbose = verbose;
+	/* watch the keyboard and mouse ourselves, poll hdaps only without them */
+	if (adaptive)
+		num_km_fds = device_find_km(km_fds, MAX_KM_DEVICES,
+		                            hardware_logic || poll_sysfs ? -1 : hdaps_input_nr);
+	if (num_km_fds == 0)
+		detector.km_activity = get_km_activity;
+	detector.auto_threshold = auto_threshold;
+	detector.predict = predict;
+	/* free-fall detection needs the z axis */
+	if (!hardware_logic && !poll_sysfs)
+		detector.three_axis = device_has_abs(hdaps_input_nr, ABS_Z);
+	else
+		detector.three_axis = position_interface == INTERFACE_AMS ||
+		                      position_interface == INTERFACE_HP3D ||
+		                      position_interface == INTERFACE_APPLESMC ||
+		                      position_interface == INTERFACE_TOSHIBA_ACPI;
+
 	if (verbose) {
-		p = disklist;
-		while (p != NULL) {
-			printf("disk: %s\n", p->name);
-			p = p->next;
-		}
+		for (i = 0; i < num_disks; i++)
+			printf("disk: %s\n", disks[i].name);
 		printf("threshold: %i\n", threshold);
+		printf("free-fall detection: %s\n", detector.three_axis ? "on" : "off");
+		if (adaptive)
+			printf("keyboard/mouse devices: %d\n", num_km_fds);
 		printf("read_method: %s\n", poll_sysfs ? "poll-sysfs" : (hardware_logic ? "hardware-logic" : "input-dev"));
 	}
 
-	/* check the protect attribute exists */
-	/* wait for it if it's not there (in case the attribute hasn't been created yet) */
-	p = disklist;
-	while (p != NULL && !dry_run) {
-		fd = open (p->protect_file, O_RDWR);
-		if (background)
-			for (i = 0; fd < 0 && i < 100; ++i) {
-				usleep (100000);	/* 10 Hz */
-				fd = open (p->protect_file, O_RDWR);
-			}
-		if (fd < 0) {
+	/* from here on, disks may come and go */
+	uevent_fd = uevent_open ();
+
+	/* open the protect attributes, they stay open for the whole run */
+	/* wait for them if they're not there (in case the attribute hasn't been created yet) */
+	deadline = get_utime() + STARTUP_WAIT_SEC;
+	for (n = 0; n < num_disks && !dry_run; n++) {
+		p = &disks[n];
+		p->protect_fd = open (p->protect_file, O_RDWR);
+		while (background && p->protect_fd < 0 &&
+		       startup_wait (p->protect_file, deadline) == 0)
+			p->protect_fd = open (p->protect_file, O_RDWR);
+		if (p->protect_fd < 0) {
 			printlog (stderr, "Could not open %s\nDoes your kernel/drive support IDLE_IMMEDIATE with UNLOAD?", p->protect_file);
-			free_disk(disklist);
+			close_disks();
 #ifdef HAVE_LIBCONFIG
 			config_destroy(&cfg);
 #endif
 			return 1;
 		}
-		close (fd);
-		p = p->next;
 	}
+	startup_mark ("protect attributes");
 
 	/* see if we can read the sensor */
 	/* wait for it if it's not there (in case the attribute hasn't been created yet) */
 	if (!hardware_logic && position_interface != INTERFACE_INPUT) {
 		ret = read_position_from_sysfs (&x, &y, &z);
-		if (background || (position_interface == INTERFACE_HDAPS && errno == EBUSY))
-			for (i = 0; ret && i < 100; ++i) {
-				usleep (100000);	/* 10 Hz */
+		/* a busy hdaps will be ready soon, but won't tell */
+		deadline = get_utime() + STARTUP_WAIT_SEC;
+		if (background || (position_interface == INTERFACE_HDAPS && ret == -EBUSY))
+			while (ret && startup_wait (position_attr.path, deadline) == 0)
 				ret = read_position_from_sysfs (&x, &y, &z);
-			}
-		if (ret) {
+		if (ret > 0) {
+			printlog(stderr, "Could not parse the position read from sysfs.");
+			return 1;
+		} else if (ret) {
 			printlog(stderr, "Could not read position from sysfs.");
 			return 1;
 		}
 	}
 
+	startup_wait_end ();
+	startup_mark ("sensor");
+
 	/* adapt to the driver's sampling rate */
 	if (position_interface == INTERFACE_HDAPS && access(HDAPS_SAMPLING_RATE_FILE, F_OK) == 0)
 		sampling_rate = read_int(HDAPS_SAMPLING_RATE_FILE);
@@ -1217,142 +2656,340 @@ int main (int argc, char** argv)
 	if (verbose)
 		printf("sampling_rate: %d\n", sampling_rate);
 
-	struct sigaction sa;
-	sigemptyset (&sa.sa_mask);
-	sa.sa_flags = 0;
+	/* lower the rate while stationary, where we can change it */
+	rate.max_rate = rate.idle_rate = rate.rate = sampling_rate;
+	if (idle_rate > 0 && idle_rate < sampling_rate && !hardware_logic) {
+		if (position_interface == INTERFACE_HDAPS && access(HDAPS_SAMPLING_RATE_FILE, F_OK) == 0)
+			rate.file = HDAPS_SAMPLING_RATE_FILE;
+		else if (position_interface == INTERFACE_HP3D)
+			rate.file = HP3D_SAMPLING_RATE_FILE;
+		if (rate.file != NULL) {
+			rate.fd = open(rate.file, O_WRONLY);
+			if (rate.fd < 0) {
+				printlog(stderr, "Could not open %s: %s", rate.file, strerror(errno));
+				rate.file = NULL;
+			}
+		}
+		if (rate.file != NULL) {
+			rate.idle_rate = rate_probe(idle_rate);
+			if (rate.idle_rate == 0) {
+				printlog(stderr, "%s takes no rate below %d Hz, ignoring --idle-rate",
+				         rate.file, rate.max_rate);
+				rate.idle_rate = rate.max_rate;
+			} else if (rate.idle_rate != idle_rate) {
+				printlog(stdout, "%s does not take %d Hz, idle rate is %d Hz",
+				         rate.file, idle_rate, rate.idle_rate);
+			}
+		} else if (poll_sysfs)
+			rate.idle_rate = idle_rate;
+		else
+			printlog(stderr, "The sampling rate of this sensor can not be changed, ignoring --idle-rate");
+		rate.since_utime = rate.active_utime = get_utime();
+	}
 
-	/* Register the handler for SIGUSR1. */
-	sa.sa_handler = SIGUSR1_handler;
-	sigaction (SIGUSR1, &sa, NULL);
+	if (trace_file != NULL) {
+		memset (&trace_hdr, 0, sizeof(trace_hdr));
+		memcpy (trace_hdr.magic, TRACE_MAGIC, sizeof(trace_hdr.magic));
+		trace_hdr.version = TRACE_VERSION;
+		trace_hdr.record_size = sizeof(struct trace_record);
+		trace_hdr.interface = position_interface;
+		trace_hdr.sampling_rate = sampling_rate;
+		ret = trace_start (trace_file, &trace_hdr);
+		if (ret == -EEXIST) {
+			printlog (stderr, "%s was recorded with another interface or sampling rate, "
+			          "record to a new file", record_file);
+			return 1;
+		} else if (ret) {
+			printlog (stderr, "%s is not a trace of this version of "PACKAGE_NAME, record_file);
+			return 1;
+		}
+		printlog (stdout, "Recording to %s", record_file);
+	}
 
-	/* Register the handler for SIGTERM. */
-	sa.sa_handler = SIGTERM_handler;
-	sigaction (SIGTERM, &sa, NULL);
+	/* Handle SIGUSR1 and SIGTERM synchronously through a signalfd. */
+	sigemptyset (&sigmask);
+	sigaddset (&sigmask, SIGUSR1);
+	sigaddset (&sigmask, SIGTERM);
+	sigprocmask (SIG_BLOCK, &sigmask, NULL);
+
+	epoll_fd = epoll_create1 (0);
+	signal_fd = signalfd (-1, &sigmask, SFD_NONBLOCK);
+	sample_timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+	unpark_timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+	pause_timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (epoll_fd < 0 || signal_fd < 0 || sample_timer_fd < 0 ||
+	    unpark_timer_fd < 0 || pause_timer_fd < 0 ||
+	    watch_fd (signal_fd, EPOLLIN) || watch_fd (sample_timer_fd, EPOLLIN) ||
+	    watch_fd (unpark_timer_fd, EPOLLIN) || watch_fd (pause_timer_fd, EPOLLIN)) {
+		printlog (stderr, "Could not set up the main loop: %s", strerror(errno));
+		return 1;
+	}
 
-	while (running) {
-		if (!hardware_logic) { /* The decision is made by the software */
-			/* Get statistics and decide what to do */
-			if (poll_sysfs) {
-				usleep (1000000/sampling_rate);
-				ret = read_position_from_sysfs (&x, &y, &z);
-				unow = get_utime(); /* microsec */
-			} else {
-				double oldunow = unow;
-				int oldx = x, oldy = y;
-				ret = read_position_from_inputdev (&x, &y, &z, &unow);
-
-				/*
-				 * The input device issues events only when the position changed.
-				 * The analysis state needs to know how long the position remained
-				 * unchanged, so send analyze() a fake retroactive update before sending
-				 * the new one.
-				 */
-				if (!ret && oldunow && unow-oldunow > 1.5/sampling_rate)
-					analyze(oldx, oldy, unow-1.0/sampling_rate, threshold, adaptive, parked);
+	if (hardware_logic) {
+		if (position_interface == INTERFACE_FREEFALL) {
+			fall_timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+			ret = fall_timer_fd < 0 || watch_fd (fall_timer_fd, EPOLLIN) ||
+			      watch_fd (freefall_fd, EPOLLIN);
+		}
+		else
+			ret = toshiba_start (hw_level);
+	} else if (poll_sysfs) {
+		sampling_start (sampling_rate);
+	} else {
+		fcntl (hdaps_input_fd, F_SETFL, O_RDONLY|O_NONBLOCK);
+		input_remember ();
+		input_retry_timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK);
+		ret = input_retry_timer_fd < 0 || watch_fd (hdaps_input_fd, EPOLLIN) ||
+		      watch_fd (input_retry_timer_fd, EPOLLIN);
+		/* without inotify, a lost device is still found by the retries */
+		input_watch_fd = inotify_init1 (IN_NONBLOCK);
+		if (!ret && input_watch_fd >= 0 &&
+		    (inotify_add_watch (input_watch_fd, "/dev/input", IN_CREATE|IN_ATTRIB) < 0 ||
+		     watch_fd (input_watch_fd, EPOLLIN))) {
+			close (input_watch_fd);
+			input_watch_fd = -1;
+		}
+	}
+	if (ret) {
+		printlog (stderr, "Could not watch the sensor: %s", strerror(errno));
+		return 1;
+	}
+	if (control_path[0]) {
+		control_fd = control_open (control_path);
+		if (control_fd == -EADDRINUSE) {
+			printlog (stderr, "%s is in use, hdapsd is already running", control_path);
+			return 1;
+		}
+		if (control_fd == -EEXIST) {
+			printlog (stderr, "%s exists and is not a socket", control_path);
+			return 1;
+		}
+		if (control_fd < 0 || watch_fd (control_fd, EPOLLIN)) {
+			printlog (stderr, "Could not listen on %s: %s", control_path,
+			          strerror (control_fd < 0 ? -control_fd : errno));
+			return 1;
+		}
+	}
+	/* follow disk hotplug, though being unable to is no reason to stop */
+	if (uevent_fd < 0 || watch_fd (uevent_fd, EPOLLIN))
+		printlog (stderr, "WARNING: Could not listen for disk hotplug events: %s",
+		          strerror (uevent_fd < 0 ? -uevent_fd : errno));
+	for (i = 0; i < num_km_fds; i++)
+		if (watch_fd (km_fds[i], EPOLLIN)) {
+			printlog (stderr, "Could not watch the keyboard/mouse: %s", strerror(errno));
+			return 1;
+		}
 
-			}
+	/* after daemon() and with the signals blocked, threads inherit the mask */
+	if (park_pool_start ())
+		return 1;
+	startup_mark ("armed");
+	stats.start_utime = get_utime();
+	if (startup_profile)
+		startup_report ();
 
-			if (ret) {
-				if (verbose)
-					printf("readout error (%d)\n", ret);
+	while (running) {
+		n = epoll_wait (epoll_fd, events, sizeof(events)/sizeof(events[0]), -1);
+		if (n < 0) {
+			if (errno == EINTR)
 				continue;
-			}
-
-			park_now = analyze(x, y, unow, threshold, adaptive, parked);
+			printlog (stderr, "epoll_wait failed: %s", strerror(errno));
+			status = 1;
+			break;
 		}
-		else /* if (hardware_logic) */ {
-			unsigned char count; /* Number of fall events */
-			if (position_interface == INTERFACE_FREEFALL) {
-				if (!parked) {
-					/* Wait for the hardware to notify a fall */
-					ret = read(freefall_fd, &count, sizeof(count));
+
+		for (i = 0; i < n && running; i++) {
+			fd = events[i].data.fd;
+
+			if (fd == signal_fd) {
+				handle_signals ();
+			} else if (fd == unpark_timer_fd) {
+				/* Freeze has expired */
+				read_timer (fd);
+				if (parked)
+					unfreeze_disks ();
+			} else if ((k = km_index (fd)) >= 0) {
+				km_drain (k, get_utime());
+			} else if (fd == pause_timer_fd) {
+				read_timer (fd);
+				paused = 0;
+				if (verbose)
+					printlog (stdout, "pause is over");
+			} else if (fd == fall_timer_fd) {
+				read_timer (fd);
+				fall_end ();
+			} else if (fd == uevent_fd) {
+				hotplug_drain ();
+			} else if (fd == control_fd) {
+				struct control_client *c = control_accept (fd);
+				if (c != NULL && watch_fd (c->fd, EPOLLIN))
+					control_close (c);
+			} else if (control_find (fd) != NULL) {
+				struct control_client *c = control_find (fd);
+				if (control_read (c, control_command))
+					control_close (c);
+			} else if (fd == input_retry_timer_fd || fd == input_watch_fd) {
+				if (fd == input_watch_fd)
+					input_watch_drain ();
+				else
+					read_timer (fd);
+				if (hdaps_input_fd < 0 &&
+				    input_attach (fd == input_retry_timer_fd) == 0) {
+					/* the axes may have moved while it was gone */
+					input_resync (&x, &y, &z);
+					unow = 0;
 				}
-				else {
-					/*
-					 * Poll to check if we no longer are falling
-					 * (hardware_logic polls only when parked)
-					 */
-					usleep (1000000/sampling_rate);
-					fcntl (freefall_fd, F_SETFL, FREEFALL_FD_FLAGS|O_NONBLOCK);
-					ret = read(freefall_fd, &count, sizeof(count));
-					fcntl (freefall_fd, F_SETFL, FREEFALL_FD_FLAGS);
-					/*
-					 * If the error is EAGAIN then it is not a real error but
-					 * a sign that the fall has ended
-					 */
-					if (ret != sizeof(count) && errno == EAGAIN) {
-						count = 0; /* set fall events count to 0 */
-						ret = sizeof(count); /* Validate count */
-					}
+			} else if (!hardware_logic && fd == sample_timer_fd) {
+				/* The decision is made by the software, polling sysfs */
+				read_timer (fd);
+				sampling_tick ();
+				ret = read_position_from_sysfs (&x, &y, &z);
+				unow = get_utime(); /* microsec */
+				if (ret) {
+					stats.read_errors++;
+					if (verbose)
+						printf("readout error (%d)\n", ret);
+				} else {
+					stats.samples++;
+					park_now = detector_step(&detector, x, y, z, unow, parked);
+					/* the sample goes before the park it causes */
+					record (TRACE_SAMPLE, (park_now ? TRACE_F_PARK_NOW : 0) |
+					        (detector.speculative ? TRACE_F_PREDICTED : 0),
+					        x, y, z, unow);
+					update_protection (park_now, unow);
+					rate_update (unow);
 				}
-			} else if (position_interface == INTERFACE_TOSHIBA_HAPS) {
-				usleep (1000000/sampling_rate);
-				ret = slurp_file(TOSHIBA_MOVEMENT_FILE, &count);
-			}
-			/* handle read errors */
-			if (ret != sizeof(count)) {
-				if (verbose)
-					printf("readout error (%d)\n", ret);
-				continue;
-			}
-			/* Display the read values in verbose mode */
-			if (verbose)
-				printf ("HW=%u\n", (unsigned) count);
-			unow = get_utime(); /* microsec */
-			park_now = (count > 0);
-		}
+			} else if (!hardware_logic && fd == hdaps_input_fd) {
+				/* The decision is made by the software, read all new positions */
+				while (1) {
+					double oldunow = unow;
+					int oldx = x, oldy = y, oldz = z;
+					ret = read_position_from_inputdev (&x, &y, &z, &unow);
+					if (ret == -EAGAIN) {
+						ret = 0;
+						break;
+					}
+					if (ret) {
+						input_lost (ret, get_utime());
+						ret = 0;
+						break;
+					}
 
-		if (park_now && !pause_now) {
-			if (!parked || unow>parked_utime+REFREEZE_SECONDS) {
-				/* Not frozen or freeze about to expire */
-				p = disklist;
-				while (p != NULL) {
-					write_protect(p->protect_file,
-					      (FREEZE_SECONDS+FREEZE_EXTRA_SECONDS) * protect_factor);
-					p = p->next;
+					/*
+					 * The input device issues events only when the position changed.
+					 * The analysis state needs to know how long the position remained
+					 * unchanged, so send the detector a fake retroactive update before sending
+					 * the new one.
+					 */
+					if (oldunow && unow-oldunow > 1.5/sampling_rate)
+						detector_step(&detector, oldx, oldy, oldz, unow-1.0/sampling_rate, parked);
+
+					stats.samples++;
+					park_now = detector_step(&detector, x, y, z, unow, parked);
+					record (TRACE_SAMPLE, TRACE_F_INPUTDEV |
+					        (park_now ? TRACE_F_PARK_NOW : 0) |
+					        (detector.speculative ? TRACE_F_PREDICTED : 0),
+					        x, y, z, unow);
+					update_protection (park_now, unow);
+					rate_update (unow);
 				}
-				/*
-				 * Write protect before any output (xterm, or
-				 * whatever else is handling our stdout, may be
-				 * swapped out).
-				 */
-				if (!parked) {
-				        printlog(stdout, "parking");
-					if (use_leds)
-						write_int (HP3D_LED_FILE, 1);
+			} else if (hardware_logic) {
+				int count; /* Number of fall events, or movement */
+				if (position_interface == INTERFACE_FREEFALL) {
+					unsigned char events;
+					/* The hardware notified a fall */
+					ret = read(freefall_fd, &events, sizeof(events));
+					if (ret == sizeof(events))
+						ret = 0;
+					else
+						ret = ret < 0 ? -errno : -EIO;
+					count = events;
+				} else {
+					/* TOSHIBA_HAPS: polled, or notified */
+					if (fd == sample_timer_fd) {
+						read_timer (fd);
+						sampling_tick ();
+					} else {
+						toshiba_notify ();
+					}
+					ret = read_toshiba_movement (&count);
 				}
-				parked = 1;
-				parked_utime = unow;
-			}
-		} else {
-			if (parked &&
-			    (pause_now || unow>parked_utime+FREEZE_SECONDS)) {
-				/* Sanity check */
-				p = disklist;
-				while (p != NULL) {
-					if (!dry_run && !read_int(p->protect_file))
-						printlog(stderr, "Error! Not parked when we "
-						       "thought we were... (paged out "
-					               "and timer expired?)");
-					/* Freeze has expired */
-					write_protect(p->protect_file, 0); /* unprotect */
-					if (use_leds)
-						write_int (HP3D_LED_FILE, 0);
-					p = p->next;
+				/* handle read errors */
+				if (ret) {
+					stats.read_errors++;
+					if (verbose)
+						printf("readout error (%d)\n", ret);
+					continue;
 				}
-				parked = 0;
-				printlog(stdout, "un-parking");
-			}
-			while (pause_now) {
-				pause_now = 0;
-				printlog(stdout, "pausing for %d seconds", SIGUSR1_SLEEP_SEC);
-				sleep(SIGUSR1_SLEEP_SEC);
+				stats.samples++;
+				/* Display the read values in verbose mode */
+				if (verbose)
+					printf ("HW=%d\n", count);
+				unow = get_utime(); /* microsec */
+				record (TRACE_SAMPLE, TRACE_F_HW_LOGIC |
+				        (count > 0 ? TRACE_F_PARK_NOW : 0), count, 0, 0, unow);
+				update_protection (count > 0, unow);
+				if (position_interface == INTERFACE_FREEFALL && count > 0)
+					fall_event (count, unow);
+				else if (position_interface == INTERFACE_TOSHIBA_HAPS)
+					toshiba_poll (count);
 			}
 		}
-
 	}
 
-	free_disk(disklist);
+	park_pool_stop ();
+	rate_report (get_utime());
+	if (rate.file != NULL)
+		close (rate.fd);
+	sampling_report ();
+	if (auto_threshold && detector.noise_sigma > 0)
+		printlog (stdout, "Sensor noise %.1f units/s, automatic threshold %.1f (minimum %d)",
+		          detector.noise_sigma, detector.noise_threshold > threshold ?
+		          detector.noise_threshold : threshold, threshold);
+	if (predict)
+		printlog (stdout, "Predicted parks: %lu, %lu of them confirmed by the movement",
+		          detector.pred.parks, detector.pred.confirmed);
+	latency_report (&latency_decide, NULL);
+	latency_report (&latency_actuate, NULL);
+	for (i = 0; i < num_disks; i++)
+		latency_report (&disks[i].park_latency, disks[i].name);
+	latency_report (&latency_total, NULL);
+	if (input_drops)
+		printlog (stdout, "Input device dropped events %lu times", input_drops);
+	if (input_rec.lost_utime)
+		input_rec.lost_time += get_utime() - input_rec.lost_utime;
+	if (input_rec.losses)
+		printlog (stdout, "Input device lost %lu times, %.1f s without protection",
+		          input_rec.losses, input_rec.lost_time);
+	fall_end ();
+	if (fall.count)
+		printlog (stdout, "Falls: %lu, lasting avg %.0f ms, max %.0f ms",
+		          fall.count, fall.sum / fall.count * 1000, fall.max * 1000);
+	if (fall_timer_fd >= 0)
+		close (fall_timer_fd);
+	if (input_retry_timer_fd >= 0)
+		close (input_retry_timer_fd);
+	if (input_watch_fd >= 0)
+		close (input_watch_fd);
+	if (uevent_fd >= 0)
+		close (uevent_fd);
+	if (control_fd >= 0)
+		control_shutdown (control_fd, control_path);
+	for (i = 0; i < num_km_fds; i++)
+		close (km_fds[i]);
+	close (pause_timer_fd);
+	close (unpark_timer_fd);
+	close (sample_timer_fd);
+	close (signal_fd);
+	close (epoll_fd);
+	if (trace_file != NULL)
+		fclose (trace_file);
+	sysfs_attr_close(&position_attr);
+	if (position_interface == INTERFACE_TOSHIBA_HAPS)
+		toshiba_stop();
+	close_disks();
+	if (led_fd >= 0)
+		close(led_fd);
 #ifdef HAVE_LIBCONFIG
 	config_destroy(&cfg);
 #endif
@@ -1361,5 +2998,5 @@ int main (int argc, char** argv)
 	if (pidfile)
 		unlink(pid_file);
 	munlockall();
-	return ret;
+	return status;
 }
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
 
 #define PID_FILE                "/var/run/hdapsd.pid"
 #define CONFIG_FILE             SYSCONFDIR"/hdapsd.conf"
@@ -23,6 +25,7 @@
 #define QUEUE_PROTECT_FMT	SYSFS_BLOCK"/%s/queue/protect"
 #define QUEUE_METHOD_FMT	SYSFS_BLOCK"/%s/queue/protect_method"
 #define BUF_LEN                 40
+#define INPUT_EVENT_BATCH       64   /* input events read per syscall */
 
 #define FORCE_PROTECT_METHOD	"unload"
 #define FORCE_UNLOAD_HEADS	"-1"
@@ -32,30 +35,15 @@
 #define FREEZE_EXTRA_SECONDS    4    /* additional timeout for kernel timer */
 #define DEFAULT_SAMPLING_RATE   50   /* default sampling frequency */
 #define SIGUSR1_SLEEP_SEC       8    /* how long to sleep upon SIGUSR1 */
-
-/* Magic threshold tweak factors, determined experimentally to make a
- * threshold of 10-20 behave reasonably.
- */
-#define VELOC_ADJUST            30.0
-#define ACCEL_ADJUST            (VELOC_ADJUST * 60)
-#define AVG_VELOC_ADJUST        3.0
-
-/* History depth for velocity average, in seconds */
-#define AVG_DEPTH_SEC           0.3
-
-/* Parameters for adaptive threshold */
-#define RECENT_PARK_SEC        3.0    /* How recent is "recently parked"? */
-#define THRESH_ADAPT_SEC       1.0    /* How often to (potentially) change
-                                       * the adaptive threshold?           */
-#define THRESH_INCREASE_FACTOR 1.1    /* Increase factor when recently
-                                       * parked but user is typing      */
-#define THRESH_DECREASE_FACTOR 0.9985 /* Decrease factor when not recently
-                                       * parked, per THRESH_ADAPT_SEC sec. */
-#define NEAR_THRESH_FACTOR     0.8    /* Fraction of threshold considered
-                                       * being near the threshold.       */
-
-/* Threshold for *continued* parking, as fraction of normal threshold */
-#define PARKED_THRESH_FACTOR   NEAR_THRESH_FACTOR /* >= NEAR_THRESH_FACTOR */
+#define IDLE_RATE_SEC           5    /* stationary this long before -w applies */
+#define RATE_RETRY_SEC          IDLE_RATE_SEC /* retry a refused rate after this long */
+#define RATE_MAX_FAILURES       3    /* refusals of the idle rate before giving up */
+#define FALL_QUIET_SEC          0.1  /* no free-fall event for this long ends a fall */
+#define TOSHIBA_FALLBACK_RATE   1    /* idle poll rate once TOSHIBA_HAPS notifies, in Hz */
+#define INPUT_RETRY_MIN_SEC     0.1  /* first search for a lost input device */
+#define INPUT_RETRY_MAX_SEC     30   /* the search backs off up to this interval */
+#define STARTUP_WAIT_SEC        10   /* wait for the protect and sensor attributes */
+#define STARTUP_RECHECK_SEC     0.1  /* look again this often while waiting, events or not */
 
 enum interfaces {
 	INTERFACE_NONE,
@@ -74,13 +62,149 @@ char *interface_names[] = {"none", "HDAPS", "AMS", "FREEFALL", "HP3D", "APPLESMC
 
 char *input_accel_names[] = {"Acer BMA150 accelerometer"};
 
+/* The drivers providing an interface, and the modaliases (fnmatch() patterns)
+ * of the hardware they drive. Only the modules matching a device are loaded. */
+#define MODALIAS_DMI_FILE	"/sys/class/dmi/id/modalias"
+#define MODALIAS_BUS_FMT	"/sys/bus/%s/devices"
+
+/* Output data rates of the lis3lv02d family in Hz, each chip takes only its own */
+const int lis3_rates[] = {1, 10, 25, 40, 50, 100, 160, 200, 400, 640};
+#define NUM_LIS3_RATES (sizeof(lis3_rates)/sizeof(lis3_rates[0]))
+
+const char *modalias_buses[] = {"acpi", "platform", "wmi", "of_platform", "macio"};
+
+#define MAX_MODALIASES		4
+
+struct module_match {
+	const char *name;
+	const char *prefer;	/* alternative for the same hardware, tried first */
+	const char *sensor;	/* ... this one only if that leaves this missing */
+	const char *modaliases[MAX_MODALIASES];
+};
+
+const struct module_match modules[] = {
+	{ "hdaps_ec",     NULL, NULL,
+	  { "dmi:*:svnIBM:*:pvrThinkPad*", "dmi:*:svnLENOVO:*:pvrThinkPad*" } },
+	{ "hdaps",        "hdaps_ec", HDAPS_POSITION_FILE,
+	  { "dmi:*:svnIBM:*:pvrThinkPad*", "dmi:*:svnLENOVO:*:pvrThinkPad*" } },
+	{ "ams",          NULL, NULL,
+	  { "of:N*T*Caccelerometer*", "of:N*T*CAAPL,accelerometer_1*" } },
+	{ "hp_accel",     NULL, NULL,
+	  { "acpi:*HPQ0004:*", "acpi:*HPQ6000:*", "acpi:*HPQ6007:*", "acpi:*HPQ6008:*" } },
+	{ "applesmc",     NULL, NULL,
+	  { "acpi:*APP0001:*", "dmi:*:svnApple*" } },
+	{ "smo8800",      NULL, NULL,
+	  { "acpi:*SMO88[0-3][01]:*", "acpi:*SMOB00[0-3]:*" } },
+	{ "toshiba_haps", NULL, NULL,
+	  { "acpi:*TOS620A:*" } },
+	{ "toshiba_acpi", NULL, NULL,
+	  { "acpi:*TOS1900:*", "acpi:*TOS620[078]:*" } },
+	{ "acer_wmi",     NULL, NULL,
+	  { "acpi:*BST0001:*", "wmi:6AF4F258-B401-42FD-BE91-3D4AC2D7C0D3*" } },
+};
+#define NUM_MODULES		((int)(sizeof(modules)/sizeof(modules[0])))
+
 enum kernel {
 	PROTECT,
 	UNLOAD_HEADS
 };
 
-struct list {
+/* Absolute-deadline clock for sysfs and hardware-logic polling */
+struct sampling_clock {
+	struct timespec deadline;  /* next sample is due at (CLOCK_MONOTONIC) */
+	long period_ns;
+	unsigned long samples;     /* samples taken, on time or late */
+	unsigned long overruns;    /* deadlines missed and skipped */
+	double jitter_sum;         /* wakeup latency past the deadline, in us */
+	double jitter_sqr_sum;
+	double jitter_max;
+};
+
+/* Sampling rate control (-w): the driver's rate while moving, a lower one
+ * while stationary */
+struct rate_control {
+	const char *file;          /* driver attribute, NULL if only polling */
+	int fd;                    /* ... kept open */
+	int max_rate;              /* the rate found at startup */
+	int idle_rate;             /* 0: rate control off */
+	int rate;                  /* current rate */
+	double active_utime;       /* last sample near the threshold, or parked */
+	double since_utime;        /* current rate set at */
+	double time_max, time_idle; /* seconds spent at each rate */
+	unsigned long switches;
+	unsigned long failures;    /* rates the driver refused */
+	int failing;               /* the last attempt failed, logged once */
+	int idle_failures;         /* refusals of the idle rate */
+	double retry_utime;        /* no new attempt before, after a refusal */
+};
+
+/* Falls reported by the hardware logic (/dev/freefall) */
+struct fall_stats {
+	double start_utime;        /* first event of the current fall, or 0 */
+	double last_utime;         /* latest event of the current fall */
+	unsigned long events;      /* events in the current fall */
+	unsigned long count;       /* falls that ended */
+	double sum, max;           /* their durations, in seconds */
+};
+
+/* The accelerometer input device, to find it again once it went away */
+struct input_recovery {
+	char name[128];            /* its name and phys, as found by device_scan() */
+	char phys[64];
+	double lost_utime;         /* lost at, or 0 */
+	double backoff;            /* seconds until the next search */
+	unsigned long losses;
+	double lost_time;          /* seconds spent without it */
+};
+
+/* A step of the startup (--startup-profile) */
+struct startup_phase {
+	const char *name;
+	double utime;              /* done at */
+};
+
+#define MAX_STARTUP_PHASES	16
+
+/* Counters for the control socket (stats) */
+struct run_stats {
+	double start_utime;
+	unsigned long samples;     /* positions or hardware reports */
+	unsigned long read_errors;
+	unsigned long parks;
+	double park_utime;         /* the current park started at */
+	double parked_time;        /* seconds parked, earlier parks */
+};
+
+#define MAX_DISKS		16
+#define MAX_KM_DEVICES		8
+
+/* Latency histogram with power-of-two buckets: bucket i counts latencies
+ * below 2^i us, the last one everything above. */
+#define LATENCY_BUCKETS		22
+
+struct latency_hist {
+	const char *name;
+	unsigned long count;
+	unsigned long bucket[LATENCY_BUCKETS];
+	double sum;		/* in us */
+	double max;		/* in us */
+};
+
+/* A protected disk, everything the park path needs is resolved at startup */
+struct disk {
 	char name[BUF_LEN];
 	char protect_file[FILENAME_MAX];
-	struct list *next;
+	int protect_fd;		/* open for the whole run, -1 if not (yet) open */
+	enum kernel method;	/* UNLOAD_HEADS or PROTECT attribute */
+	int protect_factor;	/* timeouts are in ms for unload_heads, s for protect */
+	char park_cmd[BUF_LEN];	/* freeze timeout, formatted for protect_file */
+	double done_utime;	/* completion of the last protect write */
+	struct latency_hist park_latency; /* park decision to heads parked */
+};
+
+#define PARK_WORKER_STACK	(64*1024)
+
+struct park_worker {
+	pthread_t thread;
+	struct disk *disk;
 };
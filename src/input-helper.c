@@ -18,12 +18,25 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
-#include <sys/ioctl.h>
+#include "input-helper.h"
 #include <linux/input.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+
+#define INPUT_SYSFS_DIR "/sys/class/input"
+
+#ifndef INPUT_PROP_ACCELEROMETER
+#define INPUT_PROP_ACCELEROMETER 0x06	/* linux/input.h before 3.17 */
+#endif
+
+/* all event devices, as found by the last device_scan() */
+static struct input_device *devices = NULL;
+static int num_devices = -1;	/* -1: not scanned yet */
 
 int device_open(int id) {
 	char node[32];
@@ -37,38 +50,196 @@ int device_open(int id) {
 	return fd;
 }
 
-int device_find_byphys(char *phys) {
-	int fd, i, rc;
-	char buf[1024];
-
-	for (i = 0; i < 32; i++) {
-		fd = device_open(i);
-		if (fd > 0) {
-		        rc = ioctl(fd,EVIOCGPHYS(sizeof(buf)),buf);
-			if (rc >= 0 && strcmp(phys, buf) == 0) {
-				close(fd);
-				return i;
-			}
-		}
+/*
+ * read_attr() - read a device attribute into buf, without the newline.
+ * Missing attributes (phys of virtual devices) read as "".
+ */
+static void read_attr(int id, const char *attr, char *buf, size_t len) {
+	char path[64];
+	ssize_t n = 0;
+	int fd;
+
+	snprintf(path, sizeof(path), INPUT_SYSFS_DIR"/event%d/device/%s", id, attr);
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		n = read(fd, buf, len-1);
 		close(fd);
 	}
-	return -1;
+	if (n < 0)
+		n = 0;
+	while (n > 0 && buf[n-1] == '\n')
+		n--;
+	buf[n] = 0;
 }
 
-int device_find_byname(char *name) {
-	int fd, i, rc;
-	char buf[1024];
-
-	for (i = 0; i < 32; i++) {
-		fd = device_open(i);
-		if (fd > 0) {
-		        rc = ioctl(fd,EVIOCGNAME(sizeof(buf)),buf);
-			if (rc >= 0 && strcmp(name, buf) == 0) {
-				close(fd);
-				return i;
-			}
+/*
+ * read_bitmap() - read a bitmap attribute like capabilities/key: hex words
+ * of sizeof(long), the most significant first
+ */
+static void read_bitmap(int id, const char *attr, unsigned long *bits, int n) {
+	char buf[1024], *p;
+	int i = 0;
+
+	memset(bits, 0, n*sizeof(long));
+	read_attr(id, attr, buf, sizeof(buf));
+	for (p = buf + strlen(buf); p > buf && i < n; i++) {
+		*p = 0;
+		while (p > buf && p[-1] != ' ')
+			p--;
+		bits[i] = strtoul(p, NULL, 16);
+		if (p > buf)
+			p--;
+	}
+}
+
+static int test_bit(const unsigned long *bits, int bit) {
+	return (bits[bit/(8*sizeof(long))] >> (bit%(8*sizeof(long)))) & 1;
+}
+
+/*
+ * device_scan() - (re)read the event devices from sysfs, in a single pass
+ * and without opening any of them. Returns how many there are, or -errno.
+ * The lookups below scan on their first use; rescan after loading modules.
+ */
+int device_scan(void) {
+	struct input_device *d;
+	struct dirent *de;
+	DIR *dir;
+	int id, n = 0, size = 0;
+
+	dir = opendir(INPUT_SYSFS_DIR);
+	if (dir == NULL) {
+		num_devices = 0;
+		return -errno;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (sscanf(de->d_name, "event%d", &id) != 1)
+			continue;
+		if (n == size) {
+			size = size ? 2*size : 32;
+			d = realloc(devices, size * sizeof(*devices));
+			if (d == NULL)
+				break;
+			devices = d;
 		}
-		close(fd);
+		d = &devices[n++];
+		d->id = id;
+		read_attr(id, "name", d->name, sizeof(d->name));
+		read_attr(id, "phys", d->phys, sizeof(d->phys));
+		read_bitmap(id, "properties", &d->props, 1);
+		read_bitmap(id, "capabilities/key", d->key, INPUT_KEY_LONGS);
+		read_bitmap(id, "capabilities/rel", &d->rel, 1);
+		read_bitmap(id, "capabilities/abs", &d->abs, 1);
 	}
+	closedir(dir);
+	num_devices = n;
+	return n;
+}
+
+static const struct input_device *device_get(int i) {
+	if (num_devices < 0)
+		device_scan();
+	return i < num_devices ? &devices[i] : NULL;
+}
+
+/*
+ * device_lookup() - the description of /dev/input/event<id>, or NULL
+ */
+const struct input_device *device_lookup(int id) {
+	const struct input_device *d;
+	int i;
+
+	for (i = 0; (d = device_get(i)) != NULL; i++)
+		if (d->id == id)
+			return d;
+	return NULL;
+}
+
+/*
+ * device_find() - find the device with both the given name and phys,
+ * e.g. to find a device again after it was reloaded
+ */
+int device_find(const char *name, const char *phys) {
+	const struct input_device *d;
+	int i;
+
+	for (i = 0; (d = device_get(i)) != NULL; i++)
+		if (strcmp(name, d->name) == 0 && strcmp(phys, d->phys) == 0)
+			return d->id;
+	return -1;
+}
+
+int device_find_byphys(char *phys) {
+	const struct input_device *d;
+	int i;
+
+	for (i = 0; (d = device_get(i)) != NULL; i++)
+		if (strcmp(phys, d->phys) == 0)
+			return d->id;
+	return -1;
+}
+
+int device_find_byname(char *name) {
+	const struct input_device *d;
+	int i;
+
+	for (i = 0; (d = device_get(i)) != NULL; i++)
+		if (strcmp(name, d->name) == 0)
+			return d->id;
 	return -1;
 }
+
+int device_has_abs(int id, int axis) {
+	const struct input_device *d = device_lookup(id);
+
+	return d != NULL && axis >= 0 && axis < (int) (8*sizeof(long)) &&
+	       test_bit(&d->abs, axis);
+}
+
+/*
+ * device_is_builtin_km() - is this the built-in keyboard or pointing device?
+ *
+ * The keyboard and the TrackPoint/touchpad of most laptops hang off the
+ * i8042 controller ("isa0060/serio0" and "isa0060/serio1"); newer touchpads
+ * and the Apple ones are recognized by their name. External USB or Bluetooth
+ * devices are not wanted, typing on them does not move the machine.
+ */
+static int device_is_builtin_km(const struct input_device *d) {
+	static const char *names[] = { "Internal Keyboard", "TouchPad",
+	                               "Touchpad", "Trackpad", "TrackPoint",
+	                               "bcm5974", NULL };
+	int i, builtin = 0;
+
+	if (strncmp(d->phys, "isa0060/serio", 13) == 0)
+		builtin = 1;
+	for (i = 0; !builtin && names[i] != NULL; i++)
+		if (strstr(d->name, names[i]) != NULL)
+			builtin = 1;
+	if (!builtin || test_bit(&d->props, INPUT_PROP_ACCELEROMETER))
+		return 0;
+	/* keys, relative motion or a touch surface, not just switches or LEDs */
+	return test_bit(d->key, KEY_A) || test_bit(d->key, BTN_LEFT) ||
+	       test_bit(d->key, BTN_TOUCH) || test_bit(&d->rel, REL_X);
+}
+
+/*
+ * device_find_km() - open the built-in keyboard and pointing devices,
+ * skipping the device with the given id (the accelerometer). The devices are
+ * opened non-blocking and left open, up to max of them are stored in fds.
+ * Returns how many were found.
+ */
+int device_find_km(int *fds, int max, int skip) {
+	const struct input_device *d;
+	char node[32];
+	int fd, i, n = 0;
+
+	for (i = 0; (d = device_get(i)) != NULL && n < max; i++) {
+		if (d->id == skip || !device_is_builtin_km(d))
+			continue;
+		snprintf(node, 32, "/dev/input/event%d", d->id);
+		fd = open(node, O_RDONLY|O_NONBLOCK);
+		if (fd >= 0)
+			fds[n++] = fd;
+	}
+	return n;
+}
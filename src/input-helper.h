@@ -1,3 +1,22 @@
+#include <linux/input.h>
+
+#define INPUT_KEY_LONGS		(KEY_CNT/(8*sizeof(long)) + 1)
+
+/* An event device, as described in /sys/class/input/eventN/device */
+struct input_device {
+	int id;				/* N of /dev/input/eventN */
+	char name[128];
+	char phys[64];
+	unsigned long props;		/* INPUT_PROP_* bits */
+	unsigned long key[INPUT_KEY_LONGS];	/* capabilities */
+	unsigned long rel, abs;		/* the first 64 (or 32) axes */
+};
+
+int device_scan(void);
 int device_open(int id);
+const struct input_device *device_lookup(int id);
+int device_find(const char *name, const char *phys);
 int device_find_byphys(char *phys);
 int device_find_byname(char *name);
+int device_has_abs(int id, int axis);
+int device_find_km(int *fds, int max, int skip);
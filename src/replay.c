@@ -0,0 +1,261 @@
+/*
+ * replay.c - synthetic and recorded sensor data for the offline tools
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "replay.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#define REPLAY_G		256	/* sensor units per g */
+
+static unsigned int seed;
+
+/* deterministic noise in [-amp, amp] */
+static int noise (int amp)
+{
+	seed = seed * 1103515245 + 12345;
+	return (int)((seed >> 16) % (2*amp+1)) - amp;
+}
+
+/* resting flat on a desk, sensor noise only */
+static void gen_still (double t, int *x, int *y, int *z)
+{
+	*x = noise(1);
+	*y = noise(1);
+	*z = REPLAY_G + noise(1);
+}
+
+/* typing: every keystroke shakes the sensor for one sample */
+static void gen_typing (double t, int *x, int *y, int *z)
+{
+	gen_still(t, x, y, z);
+	if (t >= REPLAY_ONSET && noise(3) == 0) {
+		*x += noise(3);
+		*y += noise(3);
+		*z += noise(3);
+	}
+}
+
+/* carried while walking: slow sway and vertical bounce */
+static void gen_walking (double t, int *x, int *y, int *z)
+{
+	gen_still(t, x, y, z);
+	if (t >= REPLAY_ONSET) {
+		*x += 10 * sin(2*M_PI*2*t);
+		*y += 5 * sin(2*M_PI*1*t);
+		*z += 20 * sin(2*M_PI*4*t);
+	}
+}
+
+/* someone knocks on the table: one sharp shock */
+static void gen_knock (double t, int *x, int *y, int *z)
+{
+	gen_still(t, x, y, z);
+	if (t >= REPLAY_ONSET && t < REPLAY_ONSET + 1.0/REPLAY_RATE) {
+		*x += 30;
+		*z += 40;
+	}
+}
+
+/* slides off the desk: tips over the edge and falls for 0.3 s */
+static void gen_tip (double t, int *x, int *y, int *z)
+{
+	double dt = t - REPLAY_ONSET;
+
+	gen_still(t, x, y, z);
+	if (dt >= 0 && dt < 0.3) {
+		*x += 300 * (dt/0.3) * (dt/0.3);
+		*y += 100 * (dt/0.3) * (dt/0.3);
+		*z = REPLAY_G * (1 - dt/0.05 > 0 ? 1 - dt/0.05 : 0) + noise(2);
+	} else if (dt >= 0.3) {
+		*x += 300;
+		*y += 100;
+	}
+}
+
+/* dropped flat from 45 cm: 0 g for 0.3 s, then the impact */
+static void gen_drop (double t, int *x, int *y, int *z)
+{
+	double dt = t - REPLAY_ONSET;
+
+	gen_still(t, x, y, z);
+	if (dt >= 0 && dt < 0.3) {
+		*x = noise(2);
+		*y = noise(2);
+		*z = noise(2);
+	} else if (dt >= 0.3 && dt < 0.3 + 1.0/REPLAY_RATE) {
+		*x += 60;
+		*y -= 40;
+		*z += 3*REPLAY_G;
+	}
+}
+
+static const struct {
+	const char *name;
+	int event;	/* should the event be detected? */
+	void (*generate)(double t, int *x, int *y, int *z);
+} scenarios[] = {
+	{ "still", 0, gen_still },
+	{ "typing", 0, gen_typing },
+	{ "walking", 0, gen_walking },
+	{ "knock", 1, gen_knock },
+	{ "tip", 1, gen_tip },
+	{ "drop", 1, gen_drop },
+};
+
+int replay_num_scenarios (void)
+{
+	return sizeof(scenarios)/sizeof(scenarios[0]);
+}
+
+/*
+ * replay_scenario() - generate synthetic scenario i, returns 0 or -errno
+ */
+int replay_scenario (struct recording *r, int i)
+{
+	int j;
+
+	memset(r, 0, sizeof(*r));
+	r->name = scenarios[i].name;
+	r->n = REPLAY_RATE * REPLAY_SECONDS;
+	r->rate = REPLAY_RATE;
+	r->three_axis = 1;
+	r->event = scenarios[i].event;
+	r->onset = REPLAY_ONSET;
+	r->s = calloc(r->n, sizeof(*r->s));
+	if (r->s == NULL)
+		return -ENOMEM;
+
+	seed = 1;
+	for (j = 0; j < r->n; j++) {
+		r->s[j].t = (double)j / REPLAY_RATE;
+		scenarios[i].generate(r->s[j].t, &r->s[j].x, &r->s[j].y, &r->s[j].z);
+	}
+	return 0;
+}
+
+/*
+ * replay_trace() - load the software-logic samples of a trace recorded with
+ * --record, returns 0 or -errno. The event labels are left to the caller.
+ */
+int replay_trace (struct recording *r, const char *path)
+{
+	struct trace_header hdr;
+	struct trace_record rec;
+	struct sample *s;
+	char *recorded;
+	int i, size = 0;
+	FILE *f;
+
+	memset(r, 0, sizeof(*r));
+	r->name = path;
+	r->onset = -1;
+	f = trace_open(path, &hdr);
+	if (f == NULL)
+		return -errno;
+	r->rate = hdr.sampling_rate;
+
+	while (trace_read(f, &rec)) {
+		if (rec.type != TRACE_SAMPLE || (rec.flags & TRACE_F_HW_LOGIC))
+			continue;
+		if (r->n == size) {
+			size = size ? size*2 : 1024;
+			s = realloc(r->s, size * sizeof(*s));
+			if (s)
+				r->s = s;
+			recorded = realloc(r->recorded, size);
+			if (recorded)
+				r->recorded = recorded;
+			if (s == NULL || recorded == NULL) {
+				fclose(f);
+				replay_free(r);
+				return -ENOMEM;
+			}
+		}
+		s = &r->s[r->n];
+		s->t = rec.usec / 1000000.0;
+		s->x = rec.x;
+		s->y = rec.y;
+		s->z = rec.z;
+		/* the daemon sends the detector a retroactive update for input devices */
+		s->retro = (rec.flags & TRACE_F_INPUTDEV) != 0;
+		r->recorded[r->n] = (rec.flags & TRACE_F_PARK_NOW) != 0;
+		if (rec.z) /* HDAPS has no z */
+			r->three_axis = 1;
+		r->n++;
+	}
+	fclose(f);
+
+	for (i = r->n-1; i >= 0; i--)
+		r->s[i].t -= r->s[0].t;
+	return 0;
+}
+
+void replay_free (struct recording *r)
+{
+	free(r->s);
+	free(r->recorded);
+	r->s = NULL;
+	r->recorded = NULL;
+	r->n = 0;
+}
+
+/*
+ * replay_step() - one sample through the kernel, and the predictor if enabled
+ */
+static int replay_step (struct detector *d, kernel_fn step, int x, int y,
+                        int z, double t, int parked)
+{
+	int above = step(d, x, y, z, t, parked);
+
+	if (!d->predict)
+		return above;
+	return detector_predict(d, x, y, t, parked, above);
+}
+
+/*
+ * replay_run() - feed a recording through a freshly reset detector like the
+ * daemon does, storing the decisions in park (if not NULL). Returns the
+ * number of samples that led to a park decision.
+ */
+int replay_run (struct detector *d, kernel_fn step, const struct recording *r,
+                char *park)
+{
+	const struct sample *s = r->s;
+	double parked_until = 0, t;
+	int i, p, parks = 0;
+
+	detector_reset(d);
+	for (i = 0; i < r->n; i++) {
+		t = REPLAY_START_SEC + s[i].t;
+		if (s[i].retro && i && s[i].t - s[i-1].t > 1.5/r->rate)
+			replay_step(d, step, s[i-1].x, s[i-1].y, s[i-1].z,
+			            t - 1.0/r->rate, t < parked_until);
+		p = replay_step(d, step, s[i].x, s[i].y, s[i].z, t,
+		                t < parked_until);
+		if (park)
+			park[i] = p;
+		if (!p)
+			continue;
+		parks++;
+		parked_until = t + REPLAY_FREEZE_SEC;
+	}
+	return parks;
+}
@@ -0,0 +1,39 @@
+#include "detector.h"
+
+/*
+ * Sensor data for the offline tools (hdapsd-bench, hdapsd-sweep): either a
+ * synthetic scenario or a trace recorded with --record. Sample times are in
+ * seconds since the first sample.
+ */
+#define REPLAY_RATE		50	/* Hz, of the synthetic scenarios */
+#define REPLAY_SECONDS		6	/* length of a synthetic scenario */
+#define REPLAY_ONSET		3.0	/* when the event in a scenario starts */
+#define REPLAY_FREEZE_SEC	1.0	/* how long a park decision lasts */
+#define REPLAY_START_SEC	1000000.0	/* simulated clock at the first sample */
+
+struct sample {
+	double t;
+	int x, y, z;
+	int retro;		/* input device: send a retroactive update first */
+};
+
+struct recording {
+	const char *name;
+	struct sample *s;
+	int n;
+	double rate;		/* nominal sampling rate, in Hz */
+	int three_axis;		/* z is valid */
+	char *recorded;		/* decisions of the recording daemon, or NULL */
+	int event;		/* contains a fall or shock that should park */
+	double onset;		/* start of the event, < 0 if unknown */
+};
+
+typedef int (*kernel_fn)(struct detector *d, int x, int y, int z,
+                         double unow, int parked);
+
+int replay_num_scenarios(void);
+int replay_scenario(struct recording *r, int i);
+int replay_trace(struct recording *r, const char *path);
+void replay_free(struct recording *r);
+int replay_run(struct detector *d, kernel_fn step, const struct recording *r,
+               char *park);
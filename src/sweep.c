@@ -0,0 +1,394 @@
+/*
+ * sweep.c - tune the detection parameters over recorded traces
+ *
+ * Replays a corpus of traces recorded with "hdapsd --record" (or the
+ * synthetic scenarios of hdapsd-bench) through the detector for every
+ * parameter set of a grid, spread over all CPUs, and reports the false
+ * park and missed event rates and the detection latency of each set.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "config.h"
+#include "replay.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define SWEEP_WINDOW_SEC	1.0	/* an event must be detected this soon */
+#define SWEEP_BATCH		8	/* parameter sets replayed side by side */
+#define SWEEP_MAX_SETS		1000000
+#define SWEEP_MAX_THREADS	256
+
+struct range {
+	double from, to, step;
+};
+
+struct param_set {
+	double threshold;
+	struct detector_params params;
+
+	/* results */
+	int events;		/* recordings with an event */
+	int missed;		/* ... not detected within SWEEP_WINDOW_SEC */
+	int timed;		/* ... detected, with a known onset */
+	double latency_sum, latency_max;
+	int false_parks;	/* parks in quiet time */
+	double quiet_sec;	/* time without an event */
+};
+
+static struct recording *corpus = NULL;
+static int corpus_len = 0;
+static struct param_set *sets = NULL;
+static int num_sets = 0;
+static int adaptive = 0;
+static int auto_threshold = 0;
+
+static pthread_mutex_t sweep_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_batch = 0;
+
+/*
+ * sweep_batch() - replay one recording for up to SWEEP_BATCH parameter sets.
+ * The sets advance sample by sample side by side, so every sample is
+ * loaded once per batch and the detectors give the CPU independent work.
+ * The kernel is the one hdapsd was built with, as in the daemon.
+ */
+static void sweep_batch (struct param_set *set, int nset, const struct recording *r)
+{
+	struct detector d[SWEEP_BATCH];
+	double parked_until[SWEEP_BATCH], detected[SWEEP_BATCH];
+	double quiet_end, t;
+	const struct sample *s = r->s;
+	int i, k, parked;
+
+	if (!r->event)
+		quiet_end = INFINITY;
+	else if (r->onset >= 0)
+		quiet_end = r->onset;
+	else
+		quiet_end = 0;
+
+	for (k = 0; k < nset; k++) {
+		detector_init(&d[k], set[k].threshold, adaptive);
+		d[k].params = set[k].params;
+		d[k].three_axis = r->three_axis;
+		d[k].auto_threshold = auto_threshold;
+		parked_until[k] = 0;
+		detected[k] = -1;
+	}
+
+	for (i = 0; i < r->n; i++) {
+		t = s[i].t;
+		for (k = 0; k < nset; k++) {
+			parked = t < parked_until[k];
+			if (s[i].retro && i && t - s[i-1].t > 1.5/r->rate)
+				detector_step(&d[k], s[i-1].x, s[i-1].y, s[i-1].z,
+				              REPLAY_START_SEC + t - 1.0/r->rate, parked);
+			if (!detector_step(&d[k], s[i].x, s[i].y, s[i].z,
+			                   REPLAY_START_SEC + t, parked))
+				continue;
+			if (t < quiet_end) {
+				if (!parked)
+					set[k].false_parks++;
+			} else if (detected[k] < 0 &&
+			           (r->onset < 0 || t < r->onset + SWEEP_WINDOW_SEC)) {
+				detected[k] = t;
+			}
+			parked_until[k] = t + REPLAY_FREEZE_SEC;
+		}
+	}
+
+	for (k = 0; k < nset; k++) {
+		if (r->n)
+			set[k].quiet_sec += fmin(quiet_end, s[r->n-1].t);
+		if (!r->event)
+			continue;
+		set[k].events++;
+		if (detected[k] < 0) {
+			set[k].missed++;
+		} else if (r->onset >= 0) {
+			set[k].timed++;
+			set[k].latency_sum += detected[k] - r->onset;
+			set[k].latency_max = fmax(set[k].latency_max, detected[k] - r->onset);
+		}
+	}
+}
+
+static void *sweep_worker (void *arg)
+{
+	int batch, j;
+
+	while (1) {
+		pthread_mutex_lock(&sweep_lock);
+		batch = next_batch++;
+		pthread_mutex_unlock(&sweep_lock);
+		if (batch * SWEEP_BATCH >= num_sets)
+			break;
+		for (j = 0; j < corpus_len; j++)
+			sweep_batch(&sets[batch * SWEEP_BATCH],
+			            num_sets - batch * SWEEP_BATCH < SWEEP_BATCH ?
+			            num_sets - batch * SWEEP_BATCH : SWEEP_BATCH,
+			            &corpus[j]);
+	}
+	return NULL;
+}
+
+/*
+ * parse_range() - "from[:to:step]", returns 0 on success
+ */
+static int parse_range (const char *arg, struct range *r)
+{
+	int n = sscanf(arg, "%lf:%lf:%lf", &r->from, &r->to, &r->step);
+
+	if (n == 1) {
+		r->to = r->from;
+		r->step = 1;
+		return 0;
+	}
+	if (n != 3 || r->step <= 0 || r->to < r->from)
+		return -1;
+	return 0;
+}
+
+static int range_count (const struct range *r)
+{
+	/* tolerate rounding, 0.7:0.9:0.1 has 3 steps */
+	return (int)floor((r->to - r->from) / r->step + 1e-9) + 1;
+}
+
+/*
+ * load_corpus_file() - "[drop[@onset]:|quiet:]trace", unlabeled traces are
+ * taken as everyday use without a fall
+ */
+static int load_corpus_file (struct recording *r, const char *arg)
+{
+	const char *path = arg;
+	int event = 0, ret;
+	double onset = -1;
+	char *end;
+
+	if (strncmp(arg, "quiet:", 6) == 0) {
+		path = arg + 6;
+	} else if (strncmp(arg, "drop:", 5) == 0) {
+		path = arg + 5;
+		event = 1;
+	} else if (strncmp(arg, "drop@", 5) == 0) {
+		onset = strtod(arg + 5, &end);
+		if (*end != ':' || onset < 0) {
+			fprintf(stderr, "%s: bad label, use drop@<seconds>:<file>\n", arg);
+			return -1;
+		}
+		path = end + 1;
+		event = 1;
+	}
+
+	ret = replay_trace(r, path);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", path, strerror(-ret));
+		return -1;
+	}
+	r->event = event;
+	r->onset = onset;
+	return 0;
+}
+
+static int cmp_sets (const void *a, const void *b)
+{
+	const struct param_set *p = a, *q = b;
+	double pl = p->timed ? p->latency_sum / p->timed : 0;
+	double ql = q->timed ? q->latency_sum / q->timed : 0;
+
+	if (p->missed != q->missed)
+		return p->missed - q->missed;
+	if (p->false_parks != q->false_parks)
+		return p->false_parks - q->false_parks;
+	return (pl > ql) - (pl < ql);
+}
+
+static void usage (const char *name)
+{
+	fprintf(stderr,
+	        "Usage: %s [options] [[drop[@<onset>]:|quiet:]<trace>...]\n"
+	        "   -s <range>   sensitivity (default 15)\n"
+	        "   -n <range>   near/parked threshold factor (default %g)\n"
+	        "   -i <range>   adaptive threshold increase factor (default %g)\n"
+	        "   -d <range>   velocity average depth in seconds (default %g)\n"
+	        "   -a           adaptive threshold\n"
+	        "   -A           automatic threshold from the sensor noise\n"
+	        "   -j <n>       worker threads (default: all CPUs)\n"
+#ifdef DETECTOR_FIXED_POINT
+	        "This build uses the fixed-point kernel, which has -n and -d compiled in.\n"
+#endif
+	        "The factors of -n, -i and -d are the NEAR_THRESH_FACTOR,\n"
+	        "THRESH_INCREASE_FACTOR and AVG_DEPTH_SEC constants of detector.h, hdapsd\n"
+	        "has to be rebuilt with the values found.\n"
+	        "A range is <value> or <from>:<to>:<step>. Traces are recorded with\n"
+	        "hdapsd --record and labeled drop: (contains a fall, optionally starting\n"
+	        "<onset> seconds after the first sample) or quiet: (the default). Without\n"
+	        "traces the synthetic scenarios of hdapsd-bench are used.\n",
+	        name, NEAR_THRESH_FACTOR, THRESH_INCREASE_FACTOR, AVG_DEPTH_SEC);
+}
+
+int main (int argc, char **argv)
+{
+	struct range sens = { 15, 15, 1 }, near = { NEAR_THRESH_FACTOR, NEAR_THRESH_FACTOR, 1 };
+	struct range incr = { THRESH_INCREASE_FACTOR, THRESH_INCREASE_FACTOR, 1 };
+	struct range depth = { AVG_DEPTH_SEC, AVG_DEPTH_SEC, 1 };
+	struct range *r = NULL;
+	pthread_t threads[SWEEP_MAX_THREADS];
+	struct param_set *p;
+	struct timespec start, end;
+	double secs, samples = 0;
+	int c, i, j, k, l, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int events = 0, tuned = 0;
+
+	while ((c = getopt(argc, argv, "s:n:i:d:aAj:h")) != -1) {
+		switch (c) {
+		case 's': r = &sens; break;
+		case 'n': r = &near; break;
+		case 'i': r = &incr; break;
+		case 'd': r = &depth; break;
+		case 'a':
+			adaptive = 1;
+			continue;
+		case 'A':
+			auto_threshold = 1;
+			continue;
+		case 'j':
+			nthreads = atoi(optarg);
+			continue;
+		default:
+			usage(argv[0]);
+			return c == 'h' ? 0 : 1;
+		}
+		if (parse_range(optarg, r)) {
+			fprintf(stderr, "Invalid range: %s\n", optarg);
+			return 1;
+		}
+#ifdef DETECTOR_FIXED_POINT
+		if (r == &near || r == &depth) {
+			fprintf(stderr, "-%c is compiled into the fixed-point kernel of this build\n", c);
+			return 1;
+		}
+#endif
+		if (r != &sens)
+			tuned = 1;
+	}
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > SWEEP_MAX_THREADS)
+		nthreads = SWEEP_MAX_THREADS;
+
+	/* the corpus */
+	corpus_len = optind < argc ? argc - optind : replay_num_scenarios();
+	corpus = calloc(corpus_len, sizeof(*corpus));
+	if (corpus == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (j = 0; j < corpus_len; j++) {
+		if (optind < argc) {
+			if (load_corpus_file(&corpus[j], argv[optind + j]))
+				return 1;
+		} else if (replay_scenario(&corpus[j], j)) {
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+		events += corpus[j].event;
+		samples += corpus[j].n;
+	}
+
+	/* the grid */
+	num_sets = range_count(&sens) * range_count(&near) *
+	           range_count(&incr) * range_count(&depth);
+	if (num_sets > SWEEP_MAX_SETS) {
+		fprintf(stderr, "%d parameter sets are too many, at most %d\n",
+		        num_sets, SWEEP_MAX_SETS);
+		return 1;
+	}
+	sets = calloc(num_sets, sizeof(*sets));
+	if (sets == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	p = sets;
+	for (i = 0; i < range_count(&sens); i++)
+	for (j = 0; j < range_count(&near); j++)
+	for (k = 0; k < range_count(&incr); k++)
+	for (l = 0; l < range_count(&depth); l++, p++) {
+		p->threshold = sens.from + i * sens.step;
+		p->params.near_thresh_factor = near.from + j * near.step;
+		p->params.parked_thresh_factor = p->params.near_thresh_factor;
+		p->params.thresh_increase_factor = incr.from + k * incr.step;
+		p->params.thresh_decrease_factor = THRESH_DECREASE_FACTOR;
+		p->params.avg_depth_sec = depth.from + l * depth.step;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, sweep_worker, NULL)) {
+			fprintf(stderr, "Could not start worker %d\n", i);
+			nthreads = i;
+			break;
+		}
+	if (nthreads == 0)
+		sweep_worker(NULL);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	qsort(sets, num_sets, sizeof(*sets), cmp_sets);
+	printf("%d recordings (%d with a fall, %.1f min quiet), %d parameter sets%s%s\n",
+	       corpus_len, events, sets[0].quiet_sec / 60, num_sets,
+	       adaptive ? ", adaptive" : "", auto_threshold ? ", automatic" : "");
+	printf("%5s %5s %6s %5s  %7s %8s %8s %8s\n", "sens", "near", "incr",
+	       "depth", "missed", "false/h", "lat avg", "lat max");
+	for (p = sets; p < sets + num_sets; p++) {
+		printf("%5g %5.3g %6.4g %5.3g  ", p->threshold,
+		       p->params.near_thresh_factor, p->params.thresh_increase_factor,
+		       p->params.avg_depth_sec);
+		if (p->events)
+			printf("%6.1f%%", 100.0 * p->missed / p->events);
+		else
+			printf("%7s", "-");
+		if (p->quiet_sec > 0)
+			printf(" %8.1f", p->false_parks * 3600 / p->quiet_sec);
+		else
+			printf(" %8s", "-");
+		if (p->timed)
+			printf(" %5.0f ms %5.0f ms\n",
+			       p->latency_sum / p->timed * 1000, p->latency_max * 1000);
+		else
+			printf(" %8s %8s\n", "-", "-");
+	}
+	if (tuned)
+		printf("The factors are constants of detector.h, rebuild hdapsd to use them.\n");
+	fflush(stdout);
+	fprintf(stderr, "%.0f samples x %d sets in %.2f s on %d threads (%.1fM samples/s)\n",
+	        samples, num_sets, secs, nthreads ? nthreads : 1,
+	        samples * num_sets / secs / 1e6);
+
+	for (j = 0; j < corpus_len; j++)
+		replay_free(&corpus[j]);
+	free(corpus);
+	free(sets);
+	return 0;
+}
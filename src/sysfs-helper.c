@@ -0,0 +1,116 @@
+/*
+ * sysfs-helper.c - read and parse sysfs attributes
+ *
+ * Copyright (C) 2005-2014 Jon Escombe <lists@dresco.co.uk>
+ *                         Robert Love <rml@novell.com>
+ *                         Evgeni Golov <evgeni@golov.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "sysfs-helper.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * sysfs_attr_open() - open the attribute once, so that later reads only
+ * cost a single pread().
+ *
+ * Since kernfs (Linux 3.14) every read at offset 0 calls the driver's show()
+ * method again, so the descriptor can be kept open for the whole run. Older
+ * sysfs implementations kept the first result in a per-open buffer; for those
+ * (and anything refusing pread()) the caller passes reopen=1 and we fall back
+ * to opening the file for every sample.
+ */
+int sysfs_attr_open (struct sysfs_attr *attr, int reopen)
+{
+	if (attr->fd >= 0)
+		close(attr->fd);
+	attr->reopen = reopen;
+	attr->fd = open(attr->path, O_RDONLY);
+	if (attr->fd < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * sysfs_attr_read() - read the current content of the attribute (up to len-1
+ * bytes) into a null-terminated string. Returns the length or -errno.
+ */
+int sysfs_attr_read (struct sysfs_attr *attr, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	if (attr->fd < 0 || attr->reopen) {
+		ret = sysfs_attr_open(attr, attr->reopen);
+		if (ret)
+			return ret;
+	}
+
+	ret = pread(attr->fd, buf, len-1, 0);
+	if (ret < 0 && errno == ESPIPE) {
+		/* not seekable after all, use the old open/read/close cycle */
+		ret = sysfs_attr_open(attr, 1);
+		if (ret)
+			return ret;
+		ret = read(attr->fd, buf, len-1);
+	}
+	if (ret < 0)
+		return -errno;
+
+	buf[ret] = 0; /* null-terminate so we can parse safely */
+	return ret;
+}
+
+/*
+ * sysfs_attr_close() - close the attribute, the next read will reopen it
+ */
+void sysfs_attr_close (struct sysfs_attr *attr)
+{
+	if (attr->fd >= 0)
+		close(attr->fd);
+	attr->fd = -1;
+}
+
+/*
+ * parse_tuple() - parse n integers in the form "<open>a<sep>b<sep>c",
+ * e.g. "(1,-2,3)" or "1 -2 3". open may be 0 if the format has no brackets,
+ * whatever follows the last integer is ignored. Returns the number of
+ * integers parsed, just like sscanf() would.
+ */
+int parse_tuple (const char *buf, char open, char sep, int *val, int n)
+{
+	const char *p = buf;
+	int i, neg, v;
+
+	if (open && *p++ != open)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (i && *p++ != sep)
+			return i;
+		neg = (*p == '-');
+		if (neg)
+			p++;
+		if (*p < '0' || *p > '9')
+			return i;
+		for (v = 0; *p >= '0' && *p <= '9'; p++)
+			v = v*10 + (*p - '0');
+		val[i] = neg ? -v : v;
+	}
+
+	return i;
+}
@@ -0,0 +1,14 @@
+#include <stddef.h>
+
+struct sysfs_attr {
+	const char *path;
+	int fd;
+	int reopen;	/* rereads at offset 0 are stale, reopen every time */
+};
+
+#define SYSFS_ATTR_INIT(p)	{ .path = (p), .fd = -1, .reopen = 0 }
+
+int sysfs_attr_open(struct sysfs_attr *attr, int reopen);
+int sysfs_attr_read(struct sysfs_attr *attr, char *buf, size_t len);
+void sysfs_attr_close(struct sysfs_attr *attr);
+int parse_tuple(const char *buf, char open, char sep, int *val, int n);
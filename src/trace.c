@@ -0,0 +1,98 @@
+/*
+ * trace.c - record and replay binary sensor traces
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "trace.h"
+#include <string.h>
+#include <errno.h>
+
+/*
+ * trace_check() - verify that the header belongs to a trace we understand
+ */
+static int trace_check (const struct trace_header *hdr)
+{
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != TRACE_VERSION ||
+	    hdr->record_size != sizeof(struct trace_record))
+		return -EINVAL;
+	return 0;
+}
+
+/*
+ * trace_start() - prepare a file opened with mode "a+" for appending records:
+ * write the header to an empty file, or check the header of an existing one.
+ * The replay relies on the header's interface and sampling rate, so a trace
+ * recorded with others is not continued (-EEXIST).
+ * Records are buffered in TRACE_BUFFER_SIZE chunks, flush with fflush().
+ */
+int trace_start (FILE *f, const struct trace_header *hdr)
+{
+	struct trace_header old;
+
+	if (setvbuf(f, NULL, _IOFBF, TRACE_BUFFER_SIZE))
+		return -ENOMEM;
+	if (fseek(f, 0, SEEK_END))
+		return -errno;
+	if (ftell(f) == 0) {
+		if (fwrite(hdr, sizeof(*hdr), 1, f) != 1 || fflush(f))
+			return -EIO;
+		return 0;
+	}
+
+	rewind(f);
+	if (fread(&old, sizeof(old), 1, f) != 1 || trace_check(&old))
+		return -EINVAL;
+	if (old.interface != hdr->interface || old.sampling_rate != hdr->sampling_rate)
+		return -EEXIST;
+	if (fseek(f, 0, SEEK_END))
+		return -errno;
+	return 0;
+}
+
+/*
+ * trace_write() - append a record (buffered)
+ */
+int trace_write (FILE *f, const struct trace_record *rec)
+{
+	if (fwrite(rec, sizeof(*rec), 1, f) != 1)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * trace_open() - open a trace for reading and return its header
+ */
+FILE *trace_open (const char *path, struct trace_header *hdr)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return NULL;
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1 || trace_check(hdr)) {
+		fclose(f);
+		errno = EINVAL;
+		return NULL;
+	}
+	return f;
+}
+
+/*
+ * trace_read() - read the next record, returns 1 on success, 0 at the end
+ */
+int trace_read (FILE *f, struct trace_record *rec)
+{
+	return fread(rec, sizeof(*rec), 1, f) == 1;
+}
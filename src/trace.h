@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Binary sensor trace, written by --record and read by the offline tools.
+ * A file is one struct trace_header followed by fixed-size records, all in
+ * host byte order. Records are only ever appended.
+ */
+#define TRACE_MAGIC		"HDAPSTRC"
+#define TRACE_VERSION		1
+#define TRACE_BUFFER_SIZE	(64*1024)	/* stdio buffer for recording */
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;	/* sizeof(struct trace_record) */
+	uint32_t interface;	/* enum interfaces of the recording daemon */
+	uint32_t sampling_rate;	/* nominal, in Hz */
+};
+
+enum trace_type {
+	TRACE_SAMPLE = 1,	/* x, y, z: raw position; x: count for hw logic */
+	TRACE_PARK,		/* disks (re)frozen */
+	TRACE_UNPARK,		/* disks unfrozen */
+	TRACE_PAUSE,		/* x: pause length in seconds */
+};
+
+#define TRACE_F_INPUTDEV	0x01	/* sample read from the input device */
+#define TRACE_F_PARK_NOW	0x02	/* the sample led to a park decision */
+#define TRACE_F_HW_LOGIC	0x04	/* sample is a hardware-logic fall count */
+#define TRACE_F_PREDICTED	0x08	/* the park decision was only predicted */
+
+struct trace_record {
+	int64_t usec;		/* sample time, in us since the epoch */
+	int32_t x, y, z;
+	uint8_t type;		/* enum trace_type */
+	uint8_t source;		/* enum interfaces the sample came from */
+	uint16_t flags;		/* TRACE_F_* */
+};
+
+int trace_start(FILE *f, const struct trace_header *hdr);
+int trace_write(FILE *f, const struct trace_record *rec);
+FILE *trace_open(const char *path, struct trace_header *hdr);
+int trace_read(FILE *f, struct trace_record *rec);
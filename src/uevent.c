@@ -0,0 +1,90 @@
+/*
+ * uevent.c - listen to the kernel's device (hot)plug events
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include "uevent.h"
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define UEVENT_GROUP_KERNEL	1	/* as sent by the kernel, not by udev */
+
+/*
+ * uevent_open() - open a non-blocking socket receiving the kernel's uevents.
+ *                 Returns the socket, or -errno.
+ */
+int uevent_open(void) {
+	struct sockaddr_nl addr;
+	int fd, err;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC,
+	            NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -errno;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = UEVENT_GROUP_KERNEL;
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	return fd;
+}
+
+/*
+ * uevent_read() - read the next uevent: "action@devpath" followed by
+ *                 KEY=value strings, all null-terminated. Messages not sent
+ *                 by the kernel, or too long for the buffer, are skipped.
+ *                 Returns 0, or -EAGAIN when there is nothing more to read,
+ *                 or another -errno.
+ */
+int uevent_read(int fd, struct uevent *ev) {
+	struct sockaddr_nl addr;
+	socklen_t addr_len;
+	ssize_t len;
+	char *p, *end;
+
+	while (1) {
+		addr_len = sizeof(addr);
+		len = recvfrom(fd, ev->buf, sizeof(ev->buf) - 1, MSG_TRUNC,
+		               (struct sockaddr *) &addr, &addr_len);
+		if (len < 0)
+			return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+		/* a truncated message would lose its last strings */
+		if (addr_len == sizeof(addr) && addr.nl_pid == 0 && len > 0 &&
+		    len < (ssize_t) sizeof(ev->buf))
+			break;
+	}
+	ev->buf[len] = 0;
+	end = ev->buf + len;
+
+	ev->action = ev->subsystem = ev->devtype = ev->devname = NULL;
+	for (p = ev->buf; p < end; p += strlen(p) + 1) {
+		if (strncmp(p, "ACTION=", 7) == 0)
+			ev->action = p + 7;
+		else if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+			ev->subsystem = p + 10;
+		else if (strncmp(p, "DEVTYPE=", 8) == 0)
+			ev->devtype = p + 8;
+		else if (strncmp(p, "DEVNAME=", 8) == 0)
+			ev->devname = p + 8;
+	}
+	return 0;
+}
@@ -0,0 +1,12 @@
+/* A kernel uevent, as much of it as hdapsd cares about */
+struct uevent {
+	const char *action;		/* "add", "remove", "change", ... */
+	const char *subsystem;
+	const char *devtype;
+	const char *devname;		/* relative to /dev, e.g. "sdb" */
+	char buf[2048 + 1];		/* the message the strings point into,
+					   up to the kernel's 2048 bytes */
+};
+
+int uevent_open(void);
+int uevent_read(int fd, struct uevent *ev);